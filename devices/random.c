@@ -30,26 +30,32 @@
 
 #include "phos.h"
 #include "hardware.h"
-#include <string.h>
+#include "ring.h"
+
+/* Random bytes are collected in a circular buffer by the top half of
+   the interrupt handler, which stops the generator when the buffer is
+   full, and wakes the driver task only when a client is waiting and
+   enough bytes have arrived. */
 
 #define NRAND 64                // Number of bytes to buffer
 
-static unsigned char randoms[NRAND];
-static unsigned nrand = 0;
+RING(randoms, NRAND);
+static volatile unsigned rng_want = 0; // Bytes wanted by waiting client
 
-/* rng_interrupt -- handle an interrupt */
-static void rng_interrupt(void) {
-    unsigned char val;
+#define nrand ring_count(&randoms)
 
-    if (RNG_VALRDY) {
-        val = RNG_VALUE;
-        if (nrand < NRAND) randoms[nrand++] = val;
+/* rng_top -- top half of interrupt handler */
+static int rng_top(void) {
+    RNG_VALRDY = 0;
+    ring_put(&randoms, RNG_VALUE);
+    if (ring_space(&randoms) == 0) RNG_STOP = 1;
 
-        // Clear and re-enable the interrupt
-        RNG_VALRDY = 0;
-        clear_pending(RNG_IRQ);
-        enable_irq(RNG_IRQ);
+    if (rng_want > 0 && nrand >= rng_want) {
+        rng_want = 0;
+        return 1;
     }
+
+    return 0;
 }
 
 /* rng_await -- wait until at least n bytes are available */
@@ -57,10 +63,15 @@ static void rng_await(int n) {
     message m;
 
     while (nrand < n) {
+        // Check again after setting rng_want, in case the generator
+        // filled the buffer and stopped in between
+        rng_want = n;
+        if (nrand >= n) break;
         receive(HARDWARE, &m);
         assert(m.m_type == INTERRUPT);
-        rng_interrupt();
     }
+
+    rng_want = 0;
 }
 
 /* random_task -- driver process for RNG */
@@ -75,13 +86,12 @@ static void random_task(int n) {
 
     // Enable and connect to the interrupt
     RNG_INTENSET = BIT(RNG_INT_VALRDY);
-    connect(RNG_IRQ);
+    connect_top(RNG_IRQ, rng_top);
 
     while (1) {
         receive(ANY, &m);
         switch (m.m_type) {
         case INTERRUPT:
-            rng_interrupt();
             break;
 
         case REQUEST:
@@ -90,10 +100,11 @@ static void random_task(int n) {
              unsigned char *buf = m.m_p2;
              assert (count <= NRAND);
              rng_await(count);
-             memcpy(buf, &randoms[nrand-count], count);
-             nrand -= count;
+             ring_read(&randoms, buf, count);
+             RNG_START = 1;     // Restart if the buffer was full
              m.m_type = OK;
              send(client, &m);
+             break;
 
         default:
             badmesg(m.m_type);
@@ -31,17 +31,25 @@
 #include "phos.h"
 #include "hardware.h"
 #include "lib.h"
+#include "ring.h"
 #include <stdarg.h>
 
 /* Message types for serial task */
 #define PUTC 6
 #define GETC 7
 
-/* There are two buffers, one for characters waiting to be output, and
-   another for input characters waiting to be read by other processes.
-   The input buffer has |n_edit| characters in the current line, still
-   subject to editing, and |n_avail| characters in previous lines that
-   are available to other processes. */
+/* There are three buffers.  Characters arriving from the UART are
+   put in a raw input buffer by the top half of the interrupt
+   handler, and moved into the input buffer by the driver task, where
+   |n_edit| characters are in the current line, still subject to
+   editing, and |n_avail| characters in previous lines are available
+   to other processes.  The output buffer holds characters waiting to
+   be sent: the task adds them, and the top half sends each one as the
+   last finishes, so the task need not be woken for every character.
+
+   The raw input buffer and the output buffer are each shared between
+   the task and the top half, one adding characters and the other
+   removing them, so they are rings as provided by ring.c. */
 
 /* NBUF -- size of input and output buffers.  Should be a power of 2. */
 #define NBUF 128
@@ -49,6 +57,10 @@
 /* wrap -- reduce index to range [0..NBUF) */
 #define wrap(x) ((x) & (NBUF-1))
 
+/* Raw input buffer */
+RING(raw, 32);
+static volatile unsigned overruns = 0; /* Characters lost */
+
 /* Input buffer */
 static char rxbuf[NBUF];        /* Circular buffer for input */
 static int rx_inp = 0;          /* In pointer */
@@ -57,22 +69,66 @@ static int n_avail = 0;         /* Number of chars avail for input */
 static int n_edit = 0;          /* Number of chars in current line */
 
 /* Output buffer */
-static char txbuf[NBUF];        /* Circular buffer for output */
-static int tx_inp = 0;          /* In pointer */
-static int tx_outp = 0;         /* Out pointer */
-static int n_tx = 0;            /* Character count */
+RING(tx, NBUF);
+#define n_tx ring_count(&tx)    /* Character count */
 
 static int reader = -1;         /* Process waiting to read */
+static int holder = ANY;        /* Client whose output is unfinished */
 
-static int txidle = 1;          /* True if transmitter is idle */
+static volatile int txidle = 1; /* True if transmitter is idle */
+static volatile int txwait = 0; /* True if task waits for space */
 
 /* echo -- echo input character */
 static void echo(char ch) {
-    if (n_tx == NBUF) return;
-    txbuf[tx_inp] = ch;
-    tx_inp = wrap(tx_inp+1);
-    n_tx++;
+    ring_put(&tx, ch);
+}
+
+#ifdef ENABLE_TRACE
+/* When CTRL-T is typed, the kernel trace buffer is sent in binary,
+   one 8-byte record per frame.  As in HDLC, each frame begins and
+   ends with a FLAG byte, and any FLAG or ESC byte inside it is sent
+   as ESC followed by the byte XOR 0x20.  The first frame contains
+   "TRC1" and the last one "TEND".  Tracing is suspended meanwhile, so
+   the output does not describe itself. */
+
+#define FLAG 0x7e
+#define ESC 0x7d
+
+static int tracing = 0;         /* True while trace is being sent */
+
+/* put_frame -- add a frame to the output buffer */
+static void put_frame(char *buf, int n) {
+    echo(FLAG);
+    for (int i = 0; i < n; i++) {
+        if (buf[i] == FLAG || buf[i] == ESC) {
+            echo(ESC); echo(buf[i] ^ 0x20);
+        } else {
+            echo(buf[i]);
+        }
+    }
+    echo(FLAG);
+}
+
+/* drain_trace -- send trace records while there is space */
+static void drain_trace(void) {
+    unsigned rec[2];
+
+    // A frame takes at most 18 bytes
+    while (NBUF - n_tx >= 18) {
+        if (! trace_get(rec)) {
+            put_frame("TEND", 4);
+            trace_freeze(0);
+            tracing = 0;
+            return;
+        }
+
+        put_frame((char *) rec, 8);
+    }
+
+    // Ask the top half for a wakeup when there is room for more
+    txwait = 1;
 }
+#endif
 
 #define CTRL(x) ((x) & 0x1f)
 
@@ -106,6 +162,16 @@ static void keypress(char ch) {
         dump();
         break;
 
+#ifdef ENABLE_TRACE
+    case CTRL('T'):
+        /* Send trace buffer */
+        if (tracing || NBUF - n_tx < 6) break;
+        trace_freeze(1);
+        put_frame("TRC1", 4);
+        tracing = 1;
+        break;
+#endif
+
     default:
         /* Ignore other control characters */
         if (ch < 040 || ch >= 0177) break;
@@ -119,26 +185,50 @@ static void keypress(char ch) {
     }
 }
 
-/* The clear_pending() call below is needed because the UART interrupt
-   handler disables the IRQ for the UART in the NVIC, but doesn't
-   disable the UART itself from sending interrupts.  The pending bit
-   is cleared on return from the interrupt handler, but that doesn't
-   stop the UART from setting it again. */
+/* serial_top -- top half of interrupt handler */
+static int serial_top(void) {
+    int wake = 0;
 
-/* serial_interrupt -- handle serial interrupt */
-static void serial_interrupt(void) {
     if (UART_RXDRDY) {
-        char ch = UART_RXD;
-        keypress(ch);
+        char ch;
+
         UART_RXDRDY = 0;
+        ch = UART_RXD;
+
+        // Wake the task for the first character of a burst, at
+        // the end of a line, or if the buffer is filling up
+        if (ring_count(&raw) == 0 || ch == '\r' || ch == '\n'
+            || ring_space(&raw) <= ring_count(&raw))
+            wake = 1;
+
+        if (! ring_put(&raw, ch)) overruns++;
     }
 
     if (UART_TXDRDY) {
-        txidle = 1;
         UART_TXDRDY = 0;
+
+        int ch = ring_get(&tx);
+        if (ch < 0)
+            txidle = 1;
+        else
+            UART_TXD = ch;
+
+        // Wake a task that is waiting for space once there is plenty
+        if (txwait && n_tx <= NBUF/2) {
+            txwait = 0;
+            wake = 1;
+        }
     }
 
-    reconnect(UART_IRQ);
+    return wake;
+}
+
+/* serial_interrupt -- deal with characters collected by the top half */
+static void serial_interrupt(void) {
+    int ch;
+
+    while ((ch = ring_get(&raw)) >= 0)
+        keypress(ch);
 }
 
 /* reply -- send reply or start transmitter if possible */
@@ -155,12 +245,47 @@ static void reply(void) {
         reader = -1;
     }
 
-    // Can we start transmitting a character?
+    // Must we start the transmitter?  If it is idle, the top half
+    // will not run again until we do, so we can take its place.
     if (txidle && n_tx > 0) {
-        UART_TXD = txbuf[tx_outp];
-        tx_outp = wrap(tx_outp+1);
-        n_tx--;
         txidle = 0;
+        UART_TXD = ring_get(&tx);
+    }
+}
+
+/* wait_space -- wait until the top half has made space for output */
+static void wait_space(void) {
+    message m;
+
+    txwait = 1;
+    reply();                    // Make sure the transmitter is running
+    receive(HARDWARE, &m);
+    serial_interrupt();
+    reply();
+}
+
+/* put_bytes -- copy characters into the output buffer */
+static void put_bytes(const char *buf, int n) {
+    while (n > 0) {
+        int k = ring_write(&tx, buf, n);
+        buf += k; n -= k;
+        if (n > 0) wait_space();
+    }
+}
+
+/* put_text -- copy text to the output buffer, with CR before each LF */
+static void put_text(const char *buf, int n) {
+    while (n > 0) {
+        int k = 0;
+
+        // Copy each run of characters up to a newline in bulk
+        while (k < n && buf[k] != '\n') k++;
+        put_bytes(buf, k);
+        if (k < n) {
+            put_bytes("\r\n", 2);
+            k++;
+        }
+        buf += k; n -= k;
     }
 }
 
@@ -188,12 +313,11 @@ static void serial_task(int n) {
     UART_TXDRDY = 0;
 
     UART_INTENSET = BIT(UART_INT_RXDRDY) | BIT(UART_INT_TXDRDY);
-    connect(UART_IRQ);
-
     txidle = 1;
+    connect_top(UART_IRQ, serial_top);
 
     while (1) {
-        receive(ANY, &m);
+        receive(holder, &m);
         client = m.m_sender;
 
         switch (m.m_type) {
@@ -209,23 +333,33 @@ static void serial_task(int n) {
             
         case PUTC:
             ch = m.m_i1;
+            put_text(&ch, 1);
+            break;
 
-            while (n_tx == NBUF) {
-                // The buffer is full -- wait for a space to appear
-                receive(HARDWARE, &m);
-                serial_interrupt();
-                reply();
-            }
+        case WRITE:
+            // The client waits while we copy straight from its buffer,
+            // and no other client is served meanwhile, so its output
+            // is not mixed with anyone else's.  If m_i3 says that more
+            // of the same output follows, we go on serving only this
+            // client until it sends the rest.
+            put_text(m.m_p1, m.m_i2);
+            holder = (m.m_i3 ? client : ANY);
+            m.m_type = OK;
+            send(client, &m);
+            break;
 
-            txbuf[tx_inp] = ch;
-            tx_inp = wrap(tx_inp+1);
-            n_tx++;
+        case ERROR:
+            // The holder has exited without finishing its output
+            holder = ANY;
             break;
 
         default:
             badmesg(m.m_type);
         }
-          
+
+#ifdef ENABLE_TRACE
+        if (tracing) drain_trace();
+#endif
         reply();
     }
 }
@@ -233,24 +367,46 @@ static void serial_task(int n) {
 /* serial_putc -- queue a character for output */
 void serial_putc(char ch) {
     message m;
-    
-    if (ch == '\n') {
-        m.m_type = PUTC;
-        m.m_i1 = '\r';
-        send(SERIAL, &m);
-    }
-
     m.m_type = PUTC;
     m.m_i1 = ch;
     send(SERIAL, &m);
 }
 
-/* serial_printf -- printf variant built on serial_putc */
+/* write_chunk -- output n characters, and say if more will follow */
+static void write_chunk(const char *buf, int n, int more) {
+    message m;
+    m.m_type = WRITE;
+    m.m_p1 = (void *) buf;
+    m.m_i2 = n;
+    m.m_i3 = more;
+    sendrec(SERIAL, &m);
+    assert(m.m_type == OK);
+}
+
+/* serial_write -- output n characters in one piece */
+void serial_write(const char *buf, int n) {
+    write_chunk(buf, n, 0);
+}
+
+/* serial_printf passes each chunk collected by _do_print straight to
+   the driver, so it needs no buffer of its own beyond the one
+   _do_print already has on the stack.  Each chunk asks the driver to
+   serve nobody else until an empty chunk at the end lets it go, so
+   the output from one call is not mixed with anyone else's. */
+
+/* write_out -- pass a chunk of output to the driver */
+static void write_out(void *q, const char *buf, int n) {
+    write_chunk(buf, n, 1);
+}
+
+/* serial_printf -- printf variant built on serial_write */
 void serial_printf(char *fmt, ...) {
     va_list va;
+
     va_start(va, fmt);
-    do_print(serial_putc, fmt, va);
+    _do_print(write_out, NULL, fmt, va);
     va_end(va);
+    write_chunk(NULL, 0, 0);
 }
 
 /* serial_getc -- request an input character */
@@ -27,63 +27,362 @@
  * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
-
 #include "phos.h"
 #include "hardware.h"
 #include "lib.h"
 
-#define TICK 5                  /* Interval between updates (ms) */
+/* Client timers are records in a table of NTIMERS.  Those that are
+   counting are kept on one of two queues in order of due time: the
+   millisecond queue, driven by the tick or the RTC as described
+   below, and the microsecond queue for short deadlines, driven by
+   compare channel CC[0] of TIMER0 running freely at 1MHz.  Each
+   record has a generation number that changes when it is freed, and
+   the handle for a timer combines its index with the generation, so
+   that a stale handle can be recognised and ignored.
 
-#define MAX_TIMERS 4
+   Clients start, cancel and reset timers without waiting for the
+   timer task: they update the record between lock() and unlock(),
+   leave a command in t_cmd, and wake the task with notify().  So a
+   client cannot deadlock with the timer task when the task is blocked
+   sending it a PING.  Each PING carries the handle in m_i2, so that a
+   client can recognise a PING that was sent before it cancelled the
+   timer.  Only timer_delay() still uses sendrec, since the PING is
+   its reply.  When a client exits, the exit hook timer_exit() leaves
+   T_CANCEL on any timers it owned, so that no PING goes to a new
+   process that is given the same pid, and the task frees them.
 
-/* Millis will overflow in about 46 days, but that's long enough. */
+   A millisecond timer may have some slack, meaning that its PING may
+   be sent up to that many ms late.  The task waits until the earliest
+   time by which some timer must be sent, then sends every timer that
+   is due by then, so timers whose windows overlap are dealt with in a
+   single pass and a single wakeup.  Each periodic timer keeps to its
+   own schedule, however late a particular PING is sent.  Only in
+   tickless mode does that save wakeups: with the tick, the task wakes
+   every TICK ms in any case, and slack saves only passes. */
 
-static unsigned millis = 0;
+#ifndef NTIMERS
+#define NTIMERS 8               // Number of timers, at most 256
+#endif
 
-struct {
-    int client;        // Process that receives message, or -1 if free
-    unsigned period;   // Interval between messages, or 0 for one-shot
-    unsigned next;     // Next time to send a message
-} timer[MAX_TIMERS];
+/* Time in ms since the timer task started: 64 bits will not wrap. */
+static volatile unsigned long long millis = 0;
 
-/* check_timers -- send any messages that are due */
-static void check_timers(void) {
-    int i;
+static struct timer {
+    short t_client;             // Process that receives PING, or -1 if free
+    byte t_gen;                 // Generation number for handles
+    byte t_cmd;                 // Command from client, or 0
+    byte t_usec;                // Whether in microsecond class
+    byte t_queued;              // Whether on a queue
+    unsigned t_delay;           // Delay requested by client
+    unsigned t_period;          // Interval between messages, or 0 for one-shot
+    unsigned t_slack;           // How late a PING may be sent (ms)
+    unsigned long long t_due;   // Next time to send a message
+    struct timer *t_next;       // Next timer in queue or free list
+} timer[NTIMERS];
+
+/* Commands in t_cmd */
+#define T_START 1
+#define T_CANCEL 2
+#define T_RESET 3
+
+static struct timer *mqueue = NULL; // Millisecond timers by due time
+static struct timer *uqueue = NULL; // Microsecond timers by due time
+static struct timer *free_timers = NULL; // Free records
+
+/* handle -- handle for a timer */
+#define handle(t) (((t)->t_gen << 8) | ((t) - timer))
+
+/* find -- find timer from handle, or NULL if stale; call with lock() */
+static struct timer *find(int h) {
+    struct timer *t;
+
+    if (h < 0 || (h & 0xff) >= NTIMERS) return NULL;
+    t = &timer[h & 0xff];
+    if (t->t_client < 0 || t->t_gen != ((h >> 8) & 0xff)) return NULL;
+    return t;
+}
+
+/* earlier -- test if timer t is due before timer u in the same class */
+static int earlier(struct timer *t, struct timer *u) {
+    if (t->t_usec)
+        // The microsecond clock has 32 bits and wraps
+        return (int) ((unsigned) t->t_due - (unsigned) u->t_due) < 0;
+    else
+        return t->t_due < u->t_due;
+}
+
+/* insert -- add a timer to its queue */
+static void insert(struct timer *t) {
+    struct timer **q = (t->t_usec ? &uqueue : &mqueue);
+
+    while (*q != NULL && ! earlier(t, *q))
+        q = &(*q)->t_next;
+
+    t->t_next = *q;
+    *q = t;
+    t->t_queued = 1;
+}
+
+/* dequeue -- remove a timer from its queue */
+static void dequeue(struct timer *t) {
+    struct timer **q = (t->t_usec ? &uqueue : &mqueue);
+
+    while (*q != t)
+        q = &(*q)->t_next;
+
+    *q = t->t_next;
+    t->t_queued = 0;
+}
+
+/* new_timer -- allocate a timer and ask for it to be started */
+static int new_timer(int client, int usec, int delay, int period, int slack) {
+    struct timer *t;
+    int h = -1;
+
+    lock();
+    t = free_timers;
+    if (t != NULL) {
+        free_timers = t->t_next;
+        t->t_client = client;
+        t->t_usec = usec;
+        t->t_delay = delay;
+        t->t_period = period;
+        t->t_slack = slack;
+        t->t_queued = 0;
+        t->t_cmd = T_START;
+        h = handle(t);
+    }
+    unlock();
+
+    return h;
+}
+
+/* free_timer -- return a timer to the free list */
+static void free_timer(struct timer *t) {
+    lock();
+    t->t_client = -1;
+    t->t_gen++;
+    t->t_cmd = 0;
+    t->t_next = free_timers;
+    free_timers = t;
+    unlock();
+}
+
+/* fire -- send a PING for a timer just taken from its queue */
+static void fire(struct timer *t) {
     message m;
+    int client = t->t_client;
+
+    // A cancelled timer is left for do_commands() to free
+    if (t->t_cmd == T_CANCEL) return;
+
+    m.m_type = PING;
+    m.m_i1 = (unsigned) t->t_due;
+    m.m_i2 = handle(t);
 
-    for (i = 0; i < MAX_TIMERS; i++) {
-        if (timer[i].client >= 0 && millis >= timer[i].next) {
-            m.m_type = PING;
-            m.m_i1 = timer[i].next;
-            send(timer[i].client, &m);
+    // Requeue or free the timer first, because send() may block
+    if (t->t_period > 0) {
+        t->t_due += t->t_period;
+        insert(t);
+    } else {
+        free_timer(t);
+    }
+
+    send(client, &m);
+}
 
-            if (timer[i].period > 0)
-                timer[i].next += timer[i].period;
-            else
-                timer[i].client = -1;
+/* timer_exit -- exit hook: cancel the timers of a process that has exited */
+static unsigned timer_exit(int pid) {
+    unsigned found = 0;
 
+    // Called in handler mode, so no client can be updating a timer
+    for (int i = 0; i < NTIMERS; i++) {
+        if (timer[i].t_client == pid) {
+            timer[i].t_cmd = T_CANCEL;
+            found = 1;
         }
     }
+
+    return found;
+}
+
+/* deadline -- latest time for the next pass, given mqueue != NULL */
+static unsigned long long deadline(void) {
+    unsigned long long d = mqueue->t_due + mqueue->t_slack;
+
+    // Timers due after d cannot make it earlier
+    for (struct timer *t = mqueue->t_next;
+         t != NULL && t->t_due < d; t = t->t_next) {
+        if (t->t_due + t->t_slack < d)
+            d = t->t_due + t->t_slack;
+    }
+
+    return d;
 }
 
-/* create -- create a new timer */
-static void create(int client, int delay, int repeat) {
-    int i = 0;
+/* Counts of wakeups of the timer task and of passes that sent PINGs
+   are turned into rates once a second, or as soon after that as the
+   task wakes. */
 
-    while (i < MAX_TIMERS && timer[i].client >= 0)
-        i++;
+static unsigned n_wakeups = 0, n_passes = 0; // Counts so far
+static unsigned long long stats_start = 0; // Time counting began
+static unsigned wakeup_rate = 0, pass_rate = 0; // Rates per second
 
-    if (i == MAX_TIMERS)
-        panic("Too many timers");
+/* stats_update -- count a wakeup, and compute rates if it is time */
+static void stats_update(void) {
+    unsigned elapsed = millis - stats_start;
 
-    timer[i].client = client;
-    timer[i].next = millis + delay;
-    if (repeat)
-        timer[i].period = delay;
-    else
-        timer[i].period = 0;
+    n_wakeups++;
+
+    if (elapsed >= 1000) {
+        wakeup_rate = (1000 * n_wakeups + elapsed/2) / elapsed;
+        pass_rate = (1000 * n_passes + elapsed/2) / elapsed;
+        n_wakeups = n_passes = 0;
+        stats_start = millis;
+    }
+}
+
+/* check_timers -- send any messages that are due */
+static void check_timers(void) {
+    if (mqueue == NULL || millis < deadline()) return;
+
+    n_passes++;
+    while (mqueue != NULL && mqueue->t_due <= millis) {
+        struct timer *t = mqueue;
+        mqueue = t->t_next;
+        t->t_queued = 0;
+        fire(t);
+    }
+}
+
+
+/* MICROSECOND TIMERS */
+
+/* The microsecond clock is TIMER0, which the kernel already runs at
+   1MHz for accounting or tracing, leaving CC[0] free.  Otherwise we
+   start it ourselves, but only when the first microsecond timer is
+   started, so that programs that use TIMER0 for other purposes are
+   not disturbed unless they also use microsecond timers.  We read the
+   clock by capturing it into CC[1], so that the compare value in
+   CC[0] is left alone.  The kernel uses CC[1] for tracing, but we
+   read it with interrupts disabled, so the two readings cannot mix. */
+
+#define MIN_USEC 10             // Shortest delay we can program
+
+static int usec_started = 0;
+
+/* usec_start -- start the clock and connect to its interrupt */
+static void usec_start(void) {
+#if !defined(ENABLE_ACCOUNTING) && !defined(ENABLE_TRACE)
+    TIMER0_STOP = 1;
+    TIMER0_MODE = TIMER_Mode_Timer;
+    TIMER0_BITMODE = TIMER_32Bit;
+    TIMER0_PRESCALER = 4;       // 1MHz = 16MHz / 2^4
+    TIMER0_CLEAR = 1;
+    TIMER0_START = 1;
+#endif
+    TIMER0_COMPARE[0] = 0;
+    TIMER0_INTENSET = BIT(TIMER_INT_COMPARE0);
+    connect(TIMER0_IRQ);
+    usec_started = 1;
+}
+
+/* usec_read -- read the microsecond clock; call with lock() */
+static unsigned usec_read(void) {
+    TIMER0_CAPTURE[1] = 1;
+    return TIMER0_CC[1];
+}
+
+/* usec_arm -- set compare for the first timer; true if it is due */
+static int usec_arm(void) {
+    unsigned due, now;
+    int late;
+
+    if (uqueue == NULL) return 0;
+
+    // Read the clock and set the compare value without interruption
+    lock();
+    now = usec_read();
+    due = uqueue->t_due;
+    late = ((int) (due - now) <= 0);
+    if ((int) (due - now) < MIN_USEC) due = now + MIN_USEC;
+    TIMER0_CC[0] = due;
+    TIMER0_COMPARE[0] = 0;
+    unlock();
+
+    return late;
+}
+
+/* usec_update -- send PINGs that are due and set compare for the next */
+static void usec_update(void) {
+    while (usec_arm()) {
+        struct timer *t = uqueue;
+        uqueue = t->t_next;
+        t->t_queued = 0;
+        fire(t);
+    }
+}
+
+
+/* CLIENT REQUESTS */
+
+/* do_commands -- act on commands left by clients */
+static void do_commands(void) {
+    for (int i = 0; i < NTIMERS; i++) {
+        struct timer *t = &timer[i];
+        int cmd;
+
+        lock();
+        cmd = t->t_cmd;
+        t->t_cmd = 0;
+        unlock();
+
+        switch (cmd) {
+        case T_START:
+        case T_RESET:
+            if (t->t_queued) dequeue(t);
+            if (! t->t_usec)
+                t->t_due = millis + t->t_delay;
+            else {
+                if (! usec_started) usec_start();
+                lock();
+                t->t_due = usec_read() + t->t_delay;
+                unlock();
+            }
+            insert(t);
+            break;
+
+        case T_CANCEL:
+            if (t->t_queued) dequeue(t);
+            free_timer(t);
+            break;
+        }
+    }
+}
+
+/* request -- deal with a message other than an interrupt */
+static void request(message *m) {
+    switch (m->m_type) {
+    case NOTIFY:
+        do_commands();
+        break;
+
+    case REGISTER:
+        // A one-shot timer for timer_delay
+        if (new_timer(m->m_sender, 0, m->m_i1, 0, m->m_i3) < 0)
+            panic("Too many timers");
+        do_commands();
+        break;
+
+    default:
+        badmesg(m->m_type);
+    }
 }
 
+#ifndef ENABLE_TICKLESS
+
+#define TICK 5                  /* Interval between updates (ms) */
+
 /* We use Timer 1 because its 16-bit mode is adequate for a clock with
    up to 1us resulution and 1ms period, leaving the 32-bit Timer 0 for
    other purposes. */
@@ -102,55 +401,279 @@ void timer_task(int n) {
     TIMER1_START = 1;
 
     connect(TIMER1_IRQ);
+    connect_exit(timer_exit);
 
     while (1) {
         receive(ANY, &m);
+        stats_update();
 
         switch (m.m_type) {
         case INTERRUPT:
-            if (TIMER1_COMPARE[0]) {
-                millis += TICK;
-                TIMER1_COMPARE[0] = 0;
-                tick(TICK);         // Check for OS timeouts
-                check_timers();
+            if (m.m_i1 & BIT(TIMER1_IRQ)) {
+                if (TIMER1_COMPARE[0]) {
+                    millis += TICK;
+                    TIMER1_COMPARE[0] = 0;
+                    tick(TICK);         // Check for OS timeouts
+                }
+                reconnect(TIMER1_IRQ);
+            }
+            if (m.m_i1 & BIT(TIMER0_IRQ)) {
+                TIMER0_COMPARE[0] = 0;
+                reconnect(TIMER0_IRQ);
             }
-            reconnect(TIMER1_IRQ);
             break;
 
-        case REGISTER:
-            create(m.m_sender, m.m_i1, m.m_i2);
+        default:
+            request(&m);
+        }
+
+        check_timers();
+        usec_update();
+    }
+}
+
+#else
+
+/* In tickless mode, the timer task sleeps until the next client timer
+   or kernel timeout is due, using a compare register of RTC1.  The
+   RTC runs from the 32.768kHz low-frequency clock, so Timer 1 and the
+   clock that drives it can stay idle.  One RTC count is 125/4096 ms,
+   and we keep the remainder in rtc_frac so that millis does not
+   drift.  The kernel sends an interrupt message whenever a process
+   sets a timeout, so that the task can wake up in time for it.
+
+   The micro:bit has no 32kHz crystal, so the clock comes from the RC
+   oscillator, which may be 2% out before calibration.  The calibration
+   timer of the CLOCK block asks for a fresh calibration against the
+   16MHz crystal every 4 seconds, keeping it within 250ppm.  A top half
+   starts each step, so the task is not woken for it. */
+
+#define MAX_SLEEP 60000         /* Longest sleep (ms), within RTC cycle */
+
+static unsigned rtc_last = 0;   // RTC count at last update
+static unsigned rtc_frac = 0;   // Left-over time in units of 1/4096 ms
+
+/* update -- bring millis up to date and return ms elapsed */
+static int update(void) {
+    unsigned now = RTC1_COUNTER;
+    int delta;
+
+    rtc_frac += 125 * ((now - rtc_last) & RTC_MASK);
+    rtc_last = now;
+    delta = rtc_frac >> 12;
+    rtc_frac &= 0xfff;
+    millis += delta;
+    return delta;
+}
+
+/* next_due -- time in ms until the next pass is due, or -1 */
+static int next_due(void) {
+    unsigned long long d;
+
+    if (mqueue == NULL) return -1;
+    d = deadline();
+    if (d <= millis) return 0;
+    if (d - millis > MAX_SLEEP) return MAX_SLEEP;
+    return d - millis;
+}
+
+/* clock_top -- top half for calibration of the RC oscillator */
+static int clock_top(void) {
+    if (CLOCK_CTTO) {
+        // The calibration timer has expired: calibrate now
+        CLOCK_CTTO = 0;
+        CLOCK_CAL = 1;
+    }
+    if (CLOCK_DONE) {
+        // Calibration has finished: start the timer again
+        CLOCK_DONE = 0;
+        CLOCK_CTSTART = 1;
+    }
+    return 0;
+}
+
+/* wake_after -- set RTC compare for ms after last update */
+static void wake_after(int ms) {
+    int ticks, gone;
+
+    if (ms < 0 || ms > MAX_SLEEP) ms = MAX_SLEEP;
+    ticks = ((ms << 12) - (int) rtc_frac + 124) / 125;
+
+    // The compare value must be at least two counts in the future
+    gone = (RTC1_COUNTER - rtc_last) & RTC_MASK;
+    if (ticks < gone + 2) ticks = gone + 2;
+
+    RTC1_COMPARE[0] = 0;
+    RTC1_CC[0] = (rtc_last + ticks) & RTC_MASK;
+}
+
+void timer_task(int n) {
+    message m;
+    int due, kdue;
+
+    // Start the low-frequency clock
+    CLOCK_LFCLKSRC = CLOCK_LFCLKSRC_RC;
+    CLOCK_LFCLKSTARTED = 0;
+    CLOCK_LFCLKSTART = 1;
+    while (! CLOCK_LFCLKSTARTED) { }
+
+    // Calibrate now, then every 4 seconds
+    CLOCK_CTIV = 16;            // In units of 0.25s
+    CLOCK_DONE = CLOCK_CTTO = 0;
+    CLOCK_INTENSET = BIT(CLOCK_INT_DONE) | BIT(CLOCK_INT_CTTO);
+    connect_top(POWER_CLOCK_IRQ, clock_top);
+    CLOCK_CAL = 1;
+
+    RTC1_STOP = 1;
+    RTC1_CLEAR = 1;
+    RTC1_PRESCALER = 0;         // 32768Hz
+    RTC1_INTENSET = BIT(RTC_INT_COMPARE0);
+    RTC1_START = 1;
+    rtc_last = RTC1_COUNTER;
+
+    connect(RTC1_IRQ);
+    connect_exit(timer_exit);
+
+    while (1) {
+        kdue = tick(update());  // Check for OS timeouts
+        stats_update();
+        check_timers();
+        usec_update();
+
+        due = next_due();
+        if (kdue >= 0 && (due < 0 || kdue < due)) due = kdue;
+        wake_after(due);
+
+        receive(ANY, &m);
+
+        switch (m.m_type) {
+        case INTERRUPT:
+            // Either the RTC has reached the compare value, or the
+            // kernel has a new timeout for us, or a microsecond
+            // timer is due.
+            if (m.m_i1 & BIT(RTC1_IRQ)) {
+                RTC1_COMPARE[0] = 0;
+                reconnect(RTC1_IRQ);
+            }
+            if (m.m_i1 & BIT(TIMER0_IRQ)) {
+                TIMER0_COMPARE[0] = 0;
+                reconnect(TIMER0_IRQ);
+            }
             break;
 
         default:
-            badmesg(m.m_type);
+            request(&m);
         }
     }
 }
 
-void timer_init(void) {
-    int i;
+#endif
 
-    for (i = 0; i < MAX_TIMERS; i++)
-        timer[i].client = -1;
+void timer_init(void) {
+    for (int i = NTIMERS-1; i >= 0; i--) {
+        timer[i].t_client = -1;
+        timer[i].t_gen = 0;
+        timer[i].t_cmd = 0;
+        timer[i].t_next = free_timers;
+        free_timers = &timer[i];
+    }
 
     start(TIMER, "Timer", timer_task, 0, 256);
 }
 
+/* timer_millis -- time in ms since the timer task started */
+unsigned long long timer_millis(void) {
+    unsigned long long t;
+
+    // Read again if the timer task changed millis half way through
+    do t = millis; while (t != millis);
+    return t;
+}
+
+/* timer_stats -- wakeups and passes per second, over the last second */
+void timer_stats(int *wakeups, int *passes) {
+    *wakeups = wakeup_rate;
+    *passes = pass_rate;
+}
+
 /* delay -- one-shot delay */
 void timer_delay(int msec) {
+#ifdef ENABLE_TIMEOUTS
+    // The kernel can do this without our help
+    sleep(msec);
+#else
     message m;
     m.m_type = REGISTER;
     m.m_i1 = msec;
     m.m_i2 = 0;                 /* Don't repeat */
+    m.m_i3 = 0;                 /* No slack */
+    sendrec(TIMER, &m);
+    assert(m.m_type == PING);
+#endif
+}
+
+/* timer_delay_slack -- delay that may last up to slack ms longer */
+void timer_delay_slack(int msec, int slack) {
+    message m;
+    m.m_type = REGISTER;
+    m.m_i1 = msec;
+    m.m_i2 = 0;
+    m.m_i3 = slack;
     sendrec(TIMER, &m);
     assert(m.m_type == PING);
 }
 
-/* pulse -- regular pulse */
-void timer_pulse(int msec) {
-     message m;
-     m.m_type = REGISTER;
-     m.m_i1 = msec;
-     m.m_i2 = 1;                /* Repetitive */
-     send(TIMER, &m);
+/* start_timer -- start a timer for the current process */
+static int start_timer(int usec, int delay, int period, int slack) {
+    int h = new_timer(getpid(), usec, delay, period, slack);
+    if (h >= 0) notify(TIMER, 1);
+    return h;
+}
+
+/* pulse -- regular pulse; returns handle or -1 */
+int timer_pulse(int msec) {
+    return start_timer(0, msec, msec, 0);
+}
+
+/* timer_pulse_slack -- regular pulse, each PING up to slack ms late */
+int timer_pulse_slack(int msec, int slack) {
+    return start_timer(0, msec, msec, slack);
+}
+
+/* timer_once -- PING once after msec; returns handle or -1 */
+int timer_once(int msec) {
+    return start_timer(0, msec, 0, 0);
+}
+
+/* timer_usec -- PING once after usec microseconds; returns handle or -1 */
+int timer_usec(int usec) {
+    return start_timer(1, usec, 0, 0);
+}
+
+/* command -- leave a command for the timer task */
+static void command(int h, int cmd, int delay) {
+    struct timer *t;
+
+    lock();
+    t = find(h);
+    if (t != NULL) {
+        if (cmd == T_RESET) {
+            t->t_delay = delay;
+            if (t->t_period > 0) t->t_period = delay;
+        }
+        t->t_cmd = cmd;
+    }
+    unlock();
+
+    if (t != NULL) notify(TIMER, 1);
+}
+
+/* timer_cancel -- stop a timer */
+void timer_cancel(int h) {
+    command(h, T_CANCEL, 0);
+}
+
+/* timer_reset -- restart a timer to expire after delay, in its units */
+void timer_reset(int h, int delay) {
+    command(h, T_RESET, delay);
 }
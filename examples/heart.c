@@ -36,9 +36,13 @@
 
 /* wait -- sleep until next timer ping */
 static void wait(void) {
+#ifdef ENABLE_TIMEOUTS
+    wait_next_period();
+#else
     message m;
     receive(TIMER, &m);
     assert(m.m_type == PING);
+#endif
 }
 
 /* heart -- filled-in heart image */
@@ -69,7 +73,11 @@ static void heart_task(int n) {
     GPIO_PINCNF[BUTTON_B] = 0;
 
     priority(P_HIGH);
+#ifdef ENABLE_TIMEOUTS
+    period(5);
+#else
     timer_pulse(5);
+#endif
 
     while (1) {
         show(heart, 70);
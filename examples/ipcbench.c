@@ -0,0 +1,356 @@
+/*
+ * ipcbench.c
+ *
+ * This file is part of the Phos operating system for microcontrollers
+ * Copyright (c) 2018 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Time the basic IPC operations in CPU cycles, using TIMER0 at 16MHz.
+   Each test spawns the helper processes it needs, times ITER
+   iterations one by one, and waits for the helpers to finish.  The
+   results come out on the serial port as CSV, one line per test,
+   giving the minimum, mean and maximum time per iteration.  All
+   processes run at P_LOW, so what each test measures is:
+
+   yield          yield() with no other process ready
+   notify_self    notify() to the caller itself, which never switches
+   recv_poll      receive_t() with timeout 0 and nothing waiting
+   yield_peer     yield() to a peer that yields straight back
+   send_waiting   send() to a receiver that is already waiting
+   send_queued    send() to a receiver that is not yet waiting, until
+                  the sender runs again
+   recv_queued    receive() from a sender that is already waiting
+   recv_block     receive() that must wait for the sender, until it
+                  returns
+   sendrec        sendrec() round trip to a server
+   recv_any_long  receive(ANY) with NQUEUE senders waiting
+   recv_pid_long  receive() from the last of NQUEUE waiting senders
+   recv_t_armed   as recv_block, but with a timeout set
+
+   The output begins with a comment line listing the kernel options,
+   so that runs with different builds can be told apart.  The first
+   three tests are system calls that return to the same process,
+   so they time the fast path through svc_handler.
+
+   The kernel must be built without ENABLE_ACCOUNTING or ENABLE_TRACE,
+   because they use TIMER0 for their own clock. */
+
+#include "phos.h"
+#include "lib.h"
+#include "hardware.h"
+
+#if defined(ENABLE_ACCOUNTING) || defined(ENABLE_TRACE)
+#error "ipcbench needs TIMER0 for itself"
+#endif
+
+#define BENCH USER
+
+/* Names of the kernel options that are enabled, for the first line */
+#ifdef ENABLE_TIMEOUTS
+#define OPT_TIMEOUTS " timeouts"
+#else
+#define OPT_TIMEOUTS ""
+#endif
+#ifdef ENABLE_TICKLESS
+#define OPT_TICKLESS " tickless"
+#else
+#define OPT_TICKLESS ""
+#endif
+#ifdef ENABLE_PRIOWAIT
+#define OPT_PRIOWAIT " priowait"
+#else
+#define OPT_PRIOWAIT ""
+#endif
+#ifdef ENABLE_MAILBOX
+#define OPT_MAILBOX " mailbox"
+#else
+#define OPT_MAILBOX ""
+#endif
+#ifdef ENABLE_TIMESLICE
+#define OPT_TIMESLICE " timeslice"
+#else
+#define OPT_TIMESLICE ""
+#endif
+
+#define ITER 1000               // Iterations per test
+#define NQUEUE 6                // Senders for the long-queue tests
+
+static volatile int alive;      // Number of helpers still running
+static int last_sender;         // Pid of the last helper spawned
+
+/* now -- read the cycle counter */
+static unsigned now(void) {
+    TIMER0_CAPTURE[1] = 1;
+    return TIMER0_CC[1];
+}
+
+/* Statistics for the current test */
+static unsigned t_min, t_max, t_sum, t_count, t_start;
+
+#define begin()  t_start = now()
+#define end()    record(now() - t_start)
+
+static void reset(void) {
+    t_min = 0xffffffff; t_max = t_sum = t_count = 0;
+}
+
+static void record(unsigned t) {
+    if (t < t_min) t_min = t;
+    if (t > t_max) t_max = t;
+    t_sum += t;
+    t_count++;
+}
+
+/* helper -- spawn a helper process that runs body(n) */
+static void helper(char *name, void (*body)(int), int n) {
+    alive++;
+    last_sender = spawn(name, body, n, 512);
+    if (last_sender < 0) panic("Can't spawn %s", name);
+}
+
+/* finish -- wait for helpers to exit, then print a line of results */
+static void finish(char *name) {
+    while (alive > 0) yield();
+    serial_printf("%s,%u,%u,%u,%u\n", name, t_count,
+                  t_min, t_sum/t_count, t_max);
+}
+
+
+/* Helper processes: each does exactly its share of the work, then
+   exits. */
+
+/* yielder -- yield n times */
+static void yielder(int n) {
+    for (int i = 0; i < n; i++) yield();
+    alive--;
+}
+
+/* receiver -- receive n messages */
+static void receiver(int n) {
+    message m;
+    for (int i = 0; i < n; i++) receive(ANY, &m);
+    alive--;
+}
+
+/* late_receiver -- yield before each receive */
+static void late_receiver(int n) {
+    message m;
+    for (int i = 0; i < n; i++) {
+        yield();
+        receive(ANY, &m);
+    }
+    alive--;
+}
+
+/* sender -- send n messages to BENCH */
+static void sender(int n) {
+    message m;
+    m.m_type = REQUEST;
+    for (int i = 0; i < n; i++) send(BENCH, &m);
+    alive--;
+}
+
+/* late_sender -- send n messages, yielding after each */
+static void late_sender(int n) {
+    message m;
+    m.m_type = REQUEST;
+    for (int i = 0; i < n; i++) {
+        send(BENCH, &m);
+        yield();
+    }
+    alive--;
+}
+
+/* server -- reply to n requests */
+static void server(int n) {
+    message m;
+    for (int i = 0; i < n; i++) {
+        receive(ANY, &m);
+        m.m_type = OK;
+        send(m.m_sender, &m);
+    }
+    alive--;
+}
+
+
+/* The tests */
+
+static void test_yield(void) {
+    reset();
+    for (int i = 0; i < ITER; i++) {
+        begin(); yield(); end();
+    }
+    finish("yield");
+
+    reset();
+    helper("Yielder", yielder, ITER);
+    for (int i = 0; i < ITER; i++) {
+        begin(); yield(); end();
+    }
+    finish("yield_peer");
+}
+
+static void test_nowait(void) {
+    message m;
+
+    reset();
+    for (int i = 0; i < ITER; i++) {
+        begin(); notify(BENCH, 1); end();
+    }
+    receive(ANY, &m);           // Collect the merged notification
+    finish("notify_self");
+
+#ifdef ENABLE_TIMEOUTS
+    reset();
+    for (int i = 0; i < ITER; i++) {
+        begin(); receive_t(ANY, &m, 0); end();
+    }
+    finish("recv_poll");
+#endif
+}
+
+static void test_send(void) {
+    message m;
+    m.m_type = REQUEST;
+
+    // The receiver runs and waits before each send
+    reset();
+    helper("Receiver", receiver, ITER);
+    for (int i = 0; i < ITER; i++) {
+        yield();
+        begin(); send(last_sender, &m); end();
+    }
+    finish("send_waiting");
+
+    // The receiver is ready but not yet waiting
+    reset();
+    helper("Receiver", late_receiver, ITER);
+    yield();
+    for (int i = 0; i < ITER; i++) {
+        begin(); send(last_sender, &m); end();
+    }
+    finish("send_queued");
+}
+
+static void test_receive(void) {
+    message m;
+
+    // The sender runs and waits before each receive
+    reset();
+    helper("Sender", sender, ITER);
+    for (int i = 0; i < ITER; i++) {
+        yield();
+        begin(); receive(ANY, &m); end();
+    }
+    finish("recv_queued");
+
+    // The sender is ready but has not yet sent
+    reset();
+    helper("Sender", late_sender, ITER);
+    for (int i = 0; i < ITER; i++) {
+        begin(); receive(ANY, &m); end();
+    }
+    finish("recv_block");
+
+#ifdef ENABLE_TIMEOUTS
+    reset();
+    helper("Sender", late_sender, ITER);
+    for (int i = 0; i < ITER; i++) {
+        begin(); receive_t(ANY, &m, 1000); end();
+    }
+    finish("recv_t_armed");
+#endif
+}
+
+static void test_sendrec(void) {
+    message m;
+
+    reset();
+    helper("Server", server, ITER);
+    for (int i = 0; i < ITER; i++) {
+        m.m_type = REQUEST;
+        begin(); sendrec(last_sender, &m); end();
+    }
+    finish("sendrec");
+}
+
+static void test_queue(void) {
+    message m;
+
+    // Let all the senders join the queue before each receive
+    reset();
+    for (int j = 0; j < NQUEUE; j++)
+        helper("Sender", sender, ITER/NQUEUE);
+    for (int i = 0; i < ITER/NQUEUE*NQUEUE; i++) {
+        yield();
+        begin(); receive(ANY, &m); end();
+    }
+    finish("recv_any_long");
+
+    // Receive from the process at the back of the queue: the others
+    // send one message each, and wait until the end
+    reset();
+    for (int j = 0; j < NQUEUE-1; j++)
+        helper("Sender", sender, 1);
+    yield();
+    helper("Sender", sender, ITER);
+    for (int i = 0; i < ITER; i++) {
+        yield();
+        begin(); receive(last_sender, &m); end();
+    }
+    for (int j = 0; j < NQUEUE-1; j++)
+        receive(ANY, &m);
+    finish("recv_pid_long");
+}
+
+static void bench_task(int n) {
+    TIMER0_STOP = 1;
+    TIMER0_MODE = TIMER_Mode_Timer;
+    TIMER0_BITMODE = TIMER_32Bit;
+    TIMER0_PRESCALER = 0;       // 16MHz
+    TIMER0_CLEAR = 1;
+    TIMER0_START = 1;
+
+    // Say how the kernel was built, so that runs can be compared
+    serial_printf("# options:%s%s%s%s%s\n", OPT_TIMEOUTS, OPT_TICKLESS,
+                  OPT_PRIOWAIT, OPT_MAILBOX, OPT_TIMESLICE);
+    serial_printf("test,iterations,min,mean,max\n");
+    test_yield();
+    test_nowait();
+    test_send();
+    test_receive();
+    test_sendrec();
+    test_queue();
+    serial_printf("# done\n");
+}
+
+void init(void) {
+    serial_init();
+#ifdef ENABLE_TIMEOUTS
+    timer_init();
+#endif
+    start(BENCH, "Bench", bench_task, 0, STACK);
+}
@@ -0,0 +1,189 @@
+/*
+ * irqlat.c
+ *
+ * This file is part of the Phos operating system for microcontrollers
+ * Copyright (c) 2018 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Measure the latency from an interrupt to the moment the handler
+   task returns from receive().  TIMER0 counts at 16MHz, and compare
+   channel CC[0] raises its interrupt at a known time; the task then
+   captures the time into CC[1], so the difference is the latency in
+   CPU cycles.  Samples are taken under three loads: an idle system, a
+   busy P_LOW process, and a pair of processes exchanging messages as
+   fast as they can.  Results are printed on the serial port.
+
+   The kernel must be built without ENABLE_ACCOUNTING or ENABLE_TRACE,
+   because they use TIMER0 for their own clock. */
+
+#include "phos.h"
+#include "lib.h"
+#include "hardware.h"
+
+#if defined(ENABLE_ACCOUNTING) || defined(ENABLE_TRACE)
+#error "irqlat needs TIMER0 for itself"
+#endif
+
+#define LAT (USER+0)
+#define BUSY (USER+1)
+#define PINGER (USER+2)
+#define PONGER (USER+3)
+
+#define NSAMPLES 2000           // Samples for each load
+#define BUCKET 16               // Width of histogram buckets (cycles)
+#define NBUCKETS 16             // Number of buckets, the last open-ended
+
+/* Possible loads */
+#define L_IDLE 0
+#define L_BUSY 1
+#define L_IPC 2
+
+static char *load_name[] = { "idle", "busy P_LOW process", "IPC traffic" };
+
+static volatile int load = L_IDLE; // Current load
+
+static unsigned hist[NBUCKETS];
+
+/* busy_task -- spin while load is L_BUSY */
+static void busy_task(int n) {
+    message m;
+
+    while (1) {
+        receive(ANY, &m);
+        while (load == L_BUSY) nop();
+    }
+}
+
+/* ping_task -- call the pong task while load is L_IPC */
+static void ping_task(int n) {
+    message m;
+
+    while (1) {
+        receive(ANY, &m);
+        while (load == L_IPC) {
+            m.m_type = REQUEST;
+            sendrec(PONGER, &m);
+        }
+    }
+}
+
+/* pong_task -- reply to every message */
+static void pong_task(int n) {
+    message m;
+
+    while (1) {
+        receive(ANY, &m);
+        m.m_type = OK;
+        send(m.m_sender, &m);
+    }
+}
+
+/* now -- read the cycle counter */
+static unsigned now(void) {
+    TIMER0_CAPTURE[1] = 1;
+    return TIMER0_CC[1];
+}
+
+/* wait_compare -- wait for an interrupt after delay cycles; return the
+   latency */
+static unsigned wait_compare(unsigned delay) {
+    message m;
+    unsigned t;
+
+    TIMER0_CC[0] = now() + delay;
+    receive(HARDWARE, &m);
+    t = now() - TIMER0_CC[0];
+    TIMER0_COMPARE[0] = 0;
+    reconnect(TIMER0_IRQ);
+    return t;
+}
+
+/* run -- take samples under the current load and print the results */
+static void run(int l) {
+    message m;
+    unsigned min = 0xffffffff, max = 0, sum = 0;
+
+    load = l;
+    m.m_type = REQUEST;
+    if (l == L_BUSY) send(BUSY, &m);
+    if (l == L_IPC) send(PINGER, &m);
+
+    for (int i = 0; i < NBUCKETS; i++) hist[i] = 0;
+
+    for (int i = 0; i < NSAMPLES; i++) {
+        // Vary the delay so the interrupt comes at different points
+        unsigned t = wait_compare(2000 + (i * 97) % 1024);
+        if (t < min) min = t;
+        if (t > max) max = t;
+        sum += t;
+        hist[t/BUCKET < NBUCKETS ? t/BUCKET : NBUCKETS-1]++;
+    }
+
+    load = L_IDLE;
+
+    serial_printf("\nLoad: %s\n", load_name[l]);
+    serial_printf("min %u mean %u max %u cycles\n", min, sum/NSAMPLES, max);
+    for (int i = 0; i < NBUCKETS; i++) {
+        if (hist[i] == 0) continue;
+        if (i < NBUCKETS-1)
+            serial_printf("%u-%u: %u\n", i*BUCKET, (i+1)*BUCKET-1, hist[i]);
+        else
+            serial_printf("%u+: %u\n", i*BUCKET, hist[i]);
+    }
+
+    // Give the serial task a second to finish printing
+    wait_compare(16000000);
+}
+
+/* lat_task -- run the tests */
+static void lat_task(int n) {
+    TIMER0_STOP = 1;
+    TIMER0_MODE = TIMER_Mode_Timer;
+    TIMER0_BITMODE = TIMER_32Bit;
+    TIMER0_PRESCALER = 0;       // 16MHz
+    TIMER0_CLEAR = 1;
+    TIMER0_CC[0] = 0xffffffff;  // No compare event until we ask
+    TIMER0_COMPARE[0] = 0;
+    TIMER0_INTENSET = BIT(TIMER_INT_COMPARE0);
+    TIMER0_START = 1;
+    connect(TIMER0_IRQ);
+
+    serial_printf("Interrupt latency, %d samples per load\n", NSAMPLES);
+
+    while (1) {
+        run(L_IDLE);
+        run(L_BUSY);
+        run(L_IPC);
+    }
+}
+
+void init(void) {
+    serial_init();
+    start(LAT, "Latency", lat_task, 0, STACK);
+    start(BUSY, "Busy", busy_task, 0, STACK);
+    start(PINGER, "Ping", ping_task, 0, STACK);
+    start(PONGER, "Pong", pong_task, 0, STACK);
+}
@@ -0,0 +1,195 @@
+/*
+ * memtime.c
+ *
+ * This file is part of the Phos operating system for microcontrollers
+ * Copyright (c) 2018 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "phos.h"
+#include "lib.h"
+#include "hardware.h"
+#include <string.h>
+
+#if defined(ENABLE_ACCOUNTING) || defined(ENABLE_TRACE)
+#error "memtime needs TIMER0 for itself"
+#endif
+
+/* This program compares the word-at-a-time memcpy and memset from
+   string-m0.s with the byte-at-a-time versions they replaced, which
+   are copied below.  Each block operation is timed with TIMER0 running
+   at 16MHz, so results are in CPU cycles, and we take the fastest of
+   ROUNDS tries to discount interrupts.  We also time the copy of a
+   message, which every send() does, and a sendrec() round trip, and
+   estimate what the new routines save at boot time, where the data
+   segment is copied from flash and the bss segment is cleared.
+
+   The kernel must be built without ENABLE_ACCOUNTING or ENABLE_TRACE,
+   because they use TIMER0 for their own clock. */
+
+#define ROUNDS 20
+#define NBUF 1024
+
+#define ECHO (USER+0)
+#define MAIN (USER+1)
+
+#define NOINLINE __attribute((noinline))
+
+/* byte_memcpy -- the old memcpy */
+static void * NOINLINE byte_memcpy(void *dest, const void *src, unsigned n) {
+    unsigned char *p = dest;
+    const unsigned char *q = src;
+    while (n-- > 0) *p++ = *q++;
+    return dest;
+}
+
+/* byte_memset -- the old memset */
+static void * NOINLINE byte_memset(void *dest, unsigned x, unsigned n) {
+    unsigned char *p = dest;
+    while (n-- > 0) *p++ = x;
+    return dest;
+}
+
+static unsigned buf1[NBUF/4], buf2[NBUF/4];
+
+/* Addresses set by the linker */
+extern unsigned __data_start[], __data_end[], __bss_start[], __bss_end[];
+
+/* cycles -- read the cycle counter */
+static unsigned cycles(void) {
+    TIMER0_CAPTURE[0] = 1;
+    return TIMER0_CC[0];
+}
+
+/* barrier -- stop the compiler moving memory accesses across this */
+#define barrier() asm volatile ("" ::: "memory")
+
+/* Each timing subtracts the time to read the clock twice, so that
+   only the operation itself is counted. */
+
+static unsigned overhead;
+
+#define TIME(result, stmt) \
+    do { \
+        unsigned best = 0xffffffff; \
+        for (int i = 0; i < ROUNDS; i++) { \
+            unsigned t0 = cycles(); \
+            barrier(); stmt; barrier(); \
+            unsigned t1 = cycles(); \
+            if (t1 - t0 < best) best = t1 - t0; \
+        } \
+        result = best - overhead; \
+    } while (0)
+
+/* copy_test -- compare copies of n bytes at given offsets */
+static void copy_test(int n, int doff, int soff) {
+    char *d = (char *) buf1 + doff, *s = (char *) buf2 + soff;
+    unsigned t_old, t_new;
+
+    TIME(t_old, byte_memcpy(d, s, n));
+    TIME(t_new, memcpy(d, s, n));
+    serial_printf("memcpy,%d,%d,%d,%d,%d\n", n, doff, soff, t_old, t_new);
+}
+
+/* set_test -- compare filling of n bytes at given offset */
+static void set_test(int n, int off) {
+    char *d = (char *) buf1 + off;
+    unsigned t_old, t_new;
+
+    TIME(t_old, byte_memset(d, 0x55, n));
+    TIME(t_new, memset(d, 0x55, n));
+    serial_printf("memset,%d,%d,0,%d,%d\n", n, off, t_old, t_new);
+}
+
+/* echo_task -- reply to each message */
+static void echo_task(int n) {
+    message m;
+
+    while (1) {
+        receive(ANY, &m);
+        send(m.m_sender, &m);
+    }
+}
+
+/* main_task -- run the tests */
+static void main_task(int n) {
+    static message m1, m2;
+    message m;
+    unsigned t_old, t_new, t_rt, t_copy, t_set;
+    unsigned data, bss;
+
+    TIME(overhead, (void) 0);
+
+    timer_delay(100);           // Let the serial line settle
+    serial_printf("op,bytes,doff,soff,old,new\n");
+
+    // Message copy, as done by the kernel for every send
+    TIME(t_old, byte_memcpy(&m2, &m1, sizeof(message)));
+    TIME(t_new, memcpy(&m2, &m1, sizeof(message)));
+    serial_printf("message,%d,0,0,%d,%d\n", sizeof(message), t_old, t_new);
+
+    copy_test(16, 0, 0);
+    copy_test(64, 0, 0);
+    copy_test(256, 0, 0);
+    copy_test(NBUF, 0, 0);
+    copy_test(255, 1, 1);       // Unaligned head and tail
+    copy_test(255, 1, 2);       // Differently aligned
+    set_test(64, 0);
+    set_test(NBUF, 0);
+    set_test(255, 3);
+
+    // IPC round trip with the new routines
+    m.m_type = PING;
+    TIME(t_rt, sendrec(ECHO, &m));
+    serial_printf("sendrec round trip: %d cycles\n", t_rt);
+
+    // Estimate boot-time initialisation from 1k copies and fills
+    data = (char *) __data_end - (char *) __data_start;
+    bss = (char *) __bss_end - (char *) __bss_start;
+    TIME(t_copy, byte_memcpy(buf1, buf2, NBUF));
+    TIME(t_set, byte_memset(buf1, 0, NBUF));
+    t_old = (data * t_copy + bss * t_set) / NBUF;
+    TIME(t_copy, memcpy(buf1, buf2, NBUF));
+    TIME(t_set, memset(buf1, 0, NBUF));
+    t_new = (data * t_copy + bss * t_set) / NBUF;
+    serial_printf("boot init (data %d, bss %d bytes): old %d, new %d cycles\n",
+                  data, bss, t_old, t_new);
+
+    exit();
+}
+
+void init(void) {
+    TIMER0_STOP = 1;
+    TIMER0_MODE = TIMER_Mode_Timer;
+    TIMER0_BITMODE = TIMER_32Bit;
+    TIMER0_PRESCALER = 0;       // 16MHz
+    TIMER0_CLEAR = 1;
+    TIMER0_START = 1;
+
+    serial_init();
+    timer_init();
+    start(ECHO, "Echo", echo_task, 0, STACK);
+    start(MAIN, "Main", main_task, 0, STACK);
+}
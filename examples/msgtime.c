@@ -33,6 +33,10 @@
 #include "hardware.h"
 #include <string.h>
 
+#if defined(ENABLE_ACCOUNTING) || defined(ENABLE_TRACE)
+#error "msgtime needs TIMER0 for itself"
+#endif
+
 #define PROCA (USER+0)
 #define PROCB (USER+1)
 
@@ -49,6 +53,20 @@
 
 #define LIGHT (1<<(ROW0+R)) | (~(1<<(COL0+C)) & COL_MASK)
 
+/* As well as making pulses that can be timed with a scope, we time
+   each round trip with TIMER0, which counts at 16MHz and so gives a
+   result in CPU cycles.  After ROUNDS trips, the average is printed.
+   The kernel must be built without ENABLE_ACCOUNTING or ENABLE_TRACE,
+   because they use TIMER0 for their own clock. */
+
+#define ROUNDS 100
+
+/* cycles -- read the cycle counter */
+static unsigned cycles(void) {
+    TIMER0_CAPTURE[0] = 1;
+    return TIMER0_CC[0];
+}
+
 void procA(int n) {
     message msg;
 
@@ -63,22 +81,40 @@ void procA(int n) {
 
 void procB(int n) {
     message msg;
+    unsigned total = 0, t0, t1;
+    int count = 0;
 
     while (1) {
-        delay(10000);           // Allow time for procA to be ready
+        timer_delay(100);       // Allow time for procA to be ready
         
         GPIO_OUT = LIGHT;
         GPIO_OUT = 0;
 
         msg.m_type = PULSE;
         GPIO_OUT = LIGHT;
+        t0 = cycles();
         sendrec(PROCA, &msg);
+        t1 = cycles();
+
+        total += t1 - t0;
+        if (++count == ROUNDS) {
+            serial_printf("sendrec round trip: %u cycles\n", total/ROUNDS);
+            total = count = 0;
+        }
     }
 }
 
 void init(void) {
     GPIO_DIRSET = ROW_MASK | COL_MASK;
 
+    TIMER0_STOP = 1;
+    TIMER0_MODE = TIMER_Mode_Timer;
+    TIMER0_BITMODE = TIMER_32Bit;
+    TIMER0_PRESCALER = 0;       // 16MHz
+    TIMER0_CLEAR = 1;
+    TIMER0_START = 1;
+
+    serial_init();
     timer_init();
     start(USER+0, "ProcA", procA, 0, STACK);
     start(USER+1, "ProcB", procB, 0, STACK);
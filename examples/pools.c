@@ -0,0 +1,106 @@
+/*
+ * pools.c
+ *
+ * This file is part of the Phos operating system for microcontrollers
+ * Copyright (c) 2018 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "phos.h"
+#include "lib.h"
+#include "hardware.h"
+
+/* A producer writes lines of text into blocks from a pool and passes
+   them to a printer process, which writes them out and frees them.
+   The producer asks for a batch of blocks at once, between lock() and
+   unlock(), and the batch is bigger than the pool, so some requests
+   fail.  At the end the pool statistics should show no blocks in use,
+   a high water mark of NBLOCKS, and the failures.  Freeing a block a
+   second time, while another block is in use, then makes the kernel
+   panic. */
+
+#define PRODUCER (USER+0)
+#define PRINTER (USER+1)
+
+#define NBLOCKS 4               // Blocks in the pool
+#define BSIZE 32                // Bytes per block
+#define BATCH 6                 // Blocks wanted at once
+#define ROUNDS 5
+
+static pool *lines;
+
+void printer(int n) {
+    message m;
+
+    while (1) {
+        receive(ANY, &m);
+        serial_printf("%s", (char *) m.m_p1);
+        pool_free(lines, m.m_p1);
+    }
+}
+
+void producer(int n) {
+    char *blk[BATCH];
+    message m;
+    int inuse, hiwater, failed;
+
+    for (int r = 0; r < ROUNDS; r++) {
+        // Allocation must leave interrupts disabled inside lock()
+        lock();
+        for (int i = 0; i < BATCH; i++)
+            blk[i] = pool_alloc(lines);
+        unlock();
+
+        for (int i = 0; i < BATCH; i++) {
+            if (blk[i] == NULL) {
+                serial_printf("Round %d, line %d: pool empty\n", r, i);
+                continue;
+            }
+
+            snprintf(blk[i], BSIZE, "Round %d, line %d\n", r, i);
+            m.m_type = REQUEST;
+            m.m_p1 = blk[i];
+            send(PRINTER, &m);
+        }
+
+        yield();                // Let the printer free the last block
+    }
+
+    pool_stats(lines, &inuse, &hiwater, &failed);
+    serial_printf("inuse=%d hiwater=%d failed=%d\n",
+                  inuse, hiwater, failed);
+    dump();
+
+    // Free a block twice, with another allocated meanwhile
+    char *keep = pool_alloc(lines);
+    pool_free(lines, (blk[0] != keep ? blk[0] : blk[1]));
+}
+
+void init(void) {
+    serial_init();
+    lines = pool_create("Lines", BSIZE, NBLOCKS);
+    start(PRODUCER, "Producer", producer, 0, STACK);
+    start(PRINTER, "Printer", printer, 0, STACK);
+}
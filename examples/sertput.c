@@ -0,0 +1,131 @@
+/*
+ * sertput.c
+ *
+ * This file is part of the Phos operating system for microcontrollers
+ * Copyright (c) 2018 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "phos.h"
+#include "lib.h"
+#include "hardware.h"
+#include <string.h>
+
+#if defined(ENABLE_ACCOUNTING) || defined(ENABLE_TRACE)
+#error "sertput needs TIMER0 for itself"
+#endif
+
+/* This program measures how fast a process can hand output to the
+   serial driver, in bytes per second, comparing the old way, with a
+   message for each character, against serial_write and serial_printf,
+   which writes in chunks.  Each test prints a line of LEN characters, timed
+   with TIMER0 at 16MHz, then waits for the line to be sent before the
+   next test.  A line fits in the driver's buffer, so the time is
+   spent in message passing and copying, not waiting for the UART,
+   which at 9600 baud can send only 960 bytes per second.
+
+   The kernel must be built without ENABLE_ACCOUNTING or ENABLE_TRACE,
+   because they use TIMER0 for their own clock. */
+
+#define LEN 60
+#define ROUNDS 10
+
+/* cycles -- read the cycle counter */
+static unsigned cycles(void) {
+    TIMER0_CAPTURE[0] = 1;
+    return TIMER0_CC[0];
+}
+
+/* old_printf -- printf as it was, one message per character */
+static void old_printf(char *fmt, ...) {
+    va_list va;
+    va_start(va, fmt);
+    do_print(serial_putc, fmt, va);
+    va_end(va);
+}
+
+/* report -- print bytes per second for a total time */
+static void report(char *what, unsigned total) {
+    unsigned bytes = ROUNDS * LEN;
+
+    // 16e6 * bytes / total, without overflow
+    serial_printf("%-12s %8u cycles/line %8u bytes/sec\n", what,
+                  total/ROUNDS, (unsigned) (16000000ULL * bytes / total));
+}
+
+static void main_task(int n) {
+    char line[LEN+1];
+    unsigned t0, t_putc = 0, t_write = 0, t_printf = 0, t_old = 0;
+
+    // A line of LEN characters ending in a newline
+    memset(line, '-', LEN-1);
+    line[LEN-1] = '\n';
+    line[LEN] = '\0';
+
+    timer_delay(100);
+    serial_printf("\nSerial throughput, %d-byte lines\n", LEN);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        timer_delay(200);
+        t0 = cycles();
+        for (int k = 0; k < LEN; k++) serial_putc(line[k]);
+        t_putc += cycles() - t0;
+
+        timer_delay(200);
+        t0 = cycles();
+        old_printf("%s", line);
+        t_old += cycles() - t0;
+
+        timer_delay(200);
+        t0 = cycles();
+        serial_write(line, LEN);
+        t_write += cycles() - t0;
+
+        timer_delay(200);
+        t0 = cycles();
+        serial_printf("%s", line);
+        t_printf += cycles() - t0;
+    }
+
+    timer_delay(200);
+    report("putc", t_putc);
+    report("old printf", t_old);
+    report("write", t_write);
+    report("printf", t_printf);
+    exit();
+}
+
+void init(void) {
+    TIMER0_STOP = 1;
+    TIMER0_MODE = TIMER_Mode_Timer;
+    TIMER0_BITMODE = TIMER_32Bit;
+    TIMER0_PRESCALER = 0;       // 16MHz
+    TIMER0_CLEAR = 1;
+    TIMER0_START = 1;
+
+    serial_init();
+    timer_init();
+    start(USER+0, "Main", main_task, 0, STACK);
+}
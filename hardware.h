@@ -65,6 +65,7 @@
 /* Interrupts */
 #define SVC_IRQ    -5
 #define PENDSV_IRQ -2
+#define POWER_CLOCK_IRQ 0
 #define RADIO_IRQ   1
 #define UART_IRQ    2
 #define I2C_IRQ     3
@@ -74,6 +75,7 @@
 #define TIMER2_IRQ 10
 #define TEMP_IRQ   12
 #define RNG_IRQ    13
+#define RTC1_IRQ   17
 
 /* System registers */
                                                                 
@@ -95,11 +97,20 @@
 /* Clock control */
 #define CLOCK_HFCLKSTART ADDR(0x40000000)
 #define CLOCK_LFCLKSTART ADDR(0x40000008)
+#define CLOCK_CAL       ADDR(0x40000010)
+#define CLOCK_CTSTART   ADDR(0x40000014)
 #define CLOCK_HFCLKSTARTED ADDR(0x40000100)
 #define CLOCK_LFCLKSTARTED ADDR(0x40000104)
+#define CLOCK_DONE      ADDR(0x4000010c)
+#define CLOCK_CTTO      ADDR(0x40000110)
+#define CLOCK_INTENSET  ADDR(0x40000304)
 #define CLOCK_LFCLKSRC  ADDR(0x40000518)
+#define CLOCK_CTIV      ADDR(0x40000538)
 #define CLOCK_XTALFREQ  ADDR(0x40000550)
      
+#define CLOCK_INT_DONE 3
+#define CLOCK_INT_CTTO 4
+
 #define CLOCK_LFCLKSRC_RC 0
 #define CLOCK_XTALFREQ_16MHz 0xFF
 
@@ -216,12 +227,31 @@
 #define TIMER2_CC       ARRAY(0x4000a540)
 
 #define TIMER_COMPARE0_CLEAR 0
+#define TIMER_COMPARE0_STOP 8
 #define TIMER_INT_COMPARE0 16
 #define TIMER_Mode_Timer 0
 #define TIMER_Mode_Counter 1
 #define TIMER_16Bit 0
 #define TIMER_32Bit 3
 
+/* RTC1 -- Real time clock driven by 32kHz LFCLK */
+#define RTC1_START     ADDR(0x40011000)
+#define RTC1_STOP      ADDR(0x40011004)
+#define RTC1_CLEAR     ADDR(0x40011008)
+#define RTC1_TICK      ADDR(0x40011100)
+#define RTC1_OVRFLW    ADDR(0x40011104)
+#define RTC1_COMPARE  ARRAY(0x40011140)
+#define RTC1_INTENSET  ADDR(0x40011304)
+#define RTC1_INTENCLR  ADDR(0x40011308)
+#define RTC1_EVTENSET  ADDR(0x40011344)
+#define RTC1_EVTENCLR  ADDR(0x40011348)
+#define RTC1_COUNTER   ADDR(0x40011504)
+#define RTC1_PRESCALER ADDR(0x40011508)
+#define RTC1_CC       ARRAY(0x40011540)
+
+#define RTC_INT_COMPARE0 16
+#define RTC_MASK 0xffffff       // The counter has 24 bits
+
 /* I2C -- Interface 0 */
 #define I2C_STARTRX    ADDR(0x40003000)
 #define I2C_STARTTX    ADDR(0x40003008)
@@ -414,5 +444,19 @@ void reschedule(void);
 #define intr_enable()   asm volatile ("cpsie i")
 #define nop()           asm volatile ("nop")
 
-/* And another one. */
-#define syscall(op)     asm volatile ("svc %0" : : "i"(op))
+/* Two more for critical sections that may be entered with interrupts
+   already disabled: intr_save saves PRIMASK in m before disabling
+   them, and intr_restore puts it back. */
+#define intr_save(m) \
+     asm volatile ("mrs %0, primask\n\tcpsid i" : "=r"(m) : : "memory")
+#define intr_restore(m) \
+     asm volatile ("msr primask, %0" : : "r"(m) : "memory")
+
+/* And another one: the call number goes in r3 as well, so that the
+   kernel need not fetch the svc instruction to find it. */
+#define syscall(op) \
+     asm volatile ("movs r3, %0\n\tsvc %0" : : "i"(op) : "r3")
+
+/* Sorry: a system call that returns a result in r0 */
+#define syscall_r0(op, r0) \
+     asm volatile ("movs r3, %1\n\tsvc %1" : "+r"(r0) : "i"(op) : "r3")
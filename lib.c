@@ -30,33 +30,57 @@
 
 #include "lib.h"
 
-#define NMAX 16                 // Max digits in a printed number
+#define NMAX 24                 // Max digits in a printed number
+
+/* The Cortex-M0 has no divide instruction, so dividing by 10 would
+   mean a call of a slow library routine for each digit printed.
+   Instead, divu10 multiplies by an approximation to 1/10 made from
+   shifts and adds (Hacker's Delight, section 10-17), then corrects
+   the quotient using the remainder.  Hex digits need only shifts. */
+
+typedef unsigned long ulong;
+
+/* divu10 -- divide by 10, setting *rem to the remainder */
+static ulong divu10(ulong x, unsigned *rem) {
+     ulong q, r;
+
+     q = (x >> 1) + (x >> 2);
+     q += q >> 4;
+     q += q >> 8;
+     q += q >> 16;
+     q += (q >> 16) >> 16;      // Matters only if long has 64 bits
+     q >>= 3;
+     r = x - (((q << 2) + q) << 1);
+     if (r > 9) {
+          q++; r -= 10;
+     }
+
+     *rem = r;
+     return q;
+}
 
 /* utoa -- convert unsigned to decimal or hex */
-static char *utoa(unsigned x, unsigned base, char *nbuf) {
+static char *utoa(ulong x, unsigned base, char *nbuf) {
      char *p = &nbuf[NMAX];
      const char *hex = "0123456789abcdef";
+     unsigned r;
 
      *--p = '\0';
-     do {
-          *--p = hex[x % base];
-          x = x / base;
-     } while (x != 0);
+     if (base == 16) {
+          do {
+               *--p = hex[x & 0xf];
+               x >>= 4;
+          } while (x != 0);
+     } else {
+          do {
+               x = divu10(x, &r);
+               *--p = '0' + r;
+          } while (x != 0);
+     }
      
      return p;
 }
 
-/* itoa -- convert signed integer to decimal */
-static char *itoa(int v, char *nbuf) {
-     if (v >= 0)
-          return utoa(v, 10, nbuf);
-     else {
-          char *p = utoa(-v, 10, nbuf);
-          *--p = '-';
-          return p;
-     }
-}
-
 /* atoi -- convert decimal string to integer */
 int atoi(const char *p) {
      unsigned x = 0;
@@ -94,66 +118,131 @@ unsigned xtou(char *p) {
 }
 
 
-/* We need sprintf to be thread-safe, so a trick is needed: in
-   _do_print, the parameter q is either a function to call or the
-   address of a character pointer used with sprintf. */
+/* Output from _do_print goes through a sink, which collects it in a
+   small buffer and passes it on a chunk at a time, rather than making
+   a call for each character.  The write function fwrite is called
+   with the parameter q, which is a function for do_print, or the
+   state of the buffer for sprintf, so that sprintf is thread-safe. */
 
-/* do_string -- output or buffer each character of a string */
-static void do_string(void (*fputc)(void *, char), void *q, char *str) {
-     for (char *p = str; *p != '\0'; p++)
-          fputc(q, *p);
+#define NSINK 32                // Size of sink buffer
+
+struct sink {
+     void (*s_write)(void *, const char *, int); /* Output function */
+     void *s_arg;               /* Parameter for s_write */
+     int s_count;               /* Characters buffered */
+     char s_buf[NSINK];         /* The buffer */
+};
+
+/* flush -- pass on buffered output */
+static void flush(struct sink *s) {
+     if (s->s_count > 0) {
+          s->s_write(s->s_arg, s->s_buf, s->s_count);
+          s->s_count = 0;
+     }
+}
+
+/* put -- output a character */
+static void put(struct sink *s, char c) {
+     s->s_buf[s->s_count++] = c;
+     if (s->s_count == NSINK) flush(s);
+}
+
+/* pad -- output n copies of a character */
+static void pad(struct sink *s, char c, int n) {
+     while (n-- > 0) put(s, c);
+}
+
+/* field -- output a string with a prefix in a field of some width */
+static void field(struct sink *s, const char *pfx, const char *str,
+                  int width, int left, int zero) {
+     if (width > 0) {
+          for (const char *p = pfx; *p != '\0'; p++) width--;
+          for (const char *p = str; *p != '\0'; p++) width--;
+     }
+
+     if (! left && ! zero) pad(s, ' ', width);
+     while (*pfx != '\0') put(s, *pfx++);
+     if (! left && zero) pad(s, '0', width);
+     while (*str != '\0') put(s, *str++);
+     if (left) pad(s, ' ', width);
 }
 
 /* _do_print -- the guts of printf */
-void _do_print(void (*fputc)(void *, char), void *q,
+void _do_print(void (*fwrite)(void *, const char *, int), void *q,
                const char *fmt, va_list va) {
-    int x;
+    struct sink sink;
     char nbuf[NMAX];
+    const char *pfx, *str;
+    int left, zero, width, lng;
+    ulong x;
+    long v;
+
+    sink.s_write = fwrite;
+    sink.s_arg = q;
+    sink.s_count = 0;
 
     for (const char *p = fmt; *p != 0; p++) {
-        if (*p == '%' && *(p+1) != '\0') {
-            switch (*++p) {
-            case 'c':
-                fputc(q, va_arg(va, int));
-                break;
-            case 'd':
-                do_string(fputc, q, itoa(va_arg(va, int), nbuf));
-                break;
-            case 's':
-                do_string(fputc, q, va_arg(va, char *));
-                break;
-            case 'u':
-                do_string(fputc, q, utoa(va_arg(va, unsigned), 10, nbuf));
-                break;
-            case 'x':
-                x = va_arg(va, unsigned);
-                if (x == 0)
-                    fputc(q, '0');
-                else {
-                    fputc(q, '0'); fputc(q, 'x');
-                    do_string(fputc, q, utoa(x, 16, nbuf));
-                }
-                break;
-            default:
-                fputc(q, *p);
-                break;
+        if (*p != '%' || *(p+1) == '\0') {
+            put(&sink, *p);
+            continue;
+        }
+
+        // Flags, then width, then size
+        left = zero = width = lng = 0;
+        for (p++; *p == '-' || *p == '0'; p++) {
+            if (*p == '-') left = 1; else zero = 1;
+        }
+        while (*p >= '0' && *p <= '9')
+            width = 10 * width + (*p++ - '0');
+        if (*p == 'l') {
+            lng = 1; p++;
+        }
+        if (*p == '\0') break;
+
+        pfx = "";
+        switch (*p) {
+        case 'c':
+            // Put the character itself, since it may be a null
+            if (! left) pad(&sink, (zero ? '0' : ' '), width-1);
+            put(&sink, va_arg(va, int));
+            if (left) pad(&sink, ' ', width-1);
+            continue;
+        case 'd':
+            v = (lng ? va_arg(va, long) : va_arg(va, int));
+            if (v >= 0)
+                str = utoa(v, 10, nbuf);
+            else {
+                pfx = "-";
+                str = utoa(- (ulong) v, 10, nbuf);
             }
-        } else {
-            fputc(q, *p);
+            break;
+        case 's':
+            str = va_arg(va, char *);
+            break;
+        case 'u':
+            x = (lng ? va_arg(va, ulong) : va_arg(va, unsigned));
+            str = utoa(x, 10, nbuf);
+            break;
+        case 'x':
+            x = (lng ? va_arg(va, ulong) : va_arg(va, unsigned));
+            if (x != 0) pfx = "0x";
+            str = utoa(x, 16, nbuf);
+            break;
+        default:
+            put(&sink, *p);
+            continue;
         }
+
+        field(&sink, pfx, str, width, left, zero);
     }
+
+    flush(&sink);
 }     
 
-/* f_printc -- call q as a function */
-static void f_printc(void *q, char c) {
+/* f_printc -- call q as a function for each character */
+static void f_printc(void *q, const char *buf, int n) {
     void (*f)(char) = q;
-    f(c);
-}
-
-/* f_storec -- use q as a character pointer */
-void f_storec(void *p, char c) {
-    char **q = (char **) p;
-    *(*q)++ = c;
+    for (int i = 0; i < n; i++) f(buf[i]);
 }
 
 /* do_print -- public skeleton for printf */
@@ -161,14 +250,66 @@ void do_print(void (*putc)(char), const char *fmt, va_list va) {
     _do_print(f_printc, (void *) putc, fmt, va);
 }
 
+/* A string buffer for sprintf and snprintf: characters beyond the
+   limit are counted but not stored. */
+struct strbuf {
+    char *sb_ptr;               /* Next free place */
+    char *sb_limit;             /* Place for the null, or NULL if none */
+    int sb_count;               /* Characters printed so far */
+};
+
+/* f_store -- add characters to a string buffer */
+static void f_store(void *q, const char *buf, int n) {
+    struct strbuf *sb = q;
+
+    for (int i = 0; i < n; i++) {
+        if (sb->sb_limit != NULL && sb->sb_ptr == sb->sb_limit) break;
+        *sb->sb_ptr++ = buf[i];
+    }
+    sb->sb_count += n;
+}
+
+/* str_print -- print to a buffer with given limit */
+static int str_print(char *buf, char *limit, const char *fmt, va_list va) {
+    struct strbuf sb;
+
+    sb.sb_ptr = buf;
+    sb.sb_limit = limit;
+    sb.sb_count = 0;
+    _do_print(f_store, &sb, fmt, va);
+    *sb.sb_ptr = '\0';
+    return sb.sb_count;
+}
+
+/* vsnprintf -- print to a character array of given size */
+int vsnprintf(char *buf, unsigned size, const char *fmt, va_list va) {
+    char dummy;
+
+    if (size == 0)
+        return str_print(&dummy, &dummy, fmt, va);
+    else
+        return str_print(buf, buf + size - 1, fmt, va);
+}
+
+/* snprintf -- print to a character array of given size */
+int snprintf(char *buf, unsigned size, const char *fmt, ...) {
+    va_list va;
+    int n;
+
+    va_start(va, fmt);
+    n = vsnprintf(buf, size, fmt, va);
+    va_end(va);
+    return n;
+}
+
 /* sprintf -- print to a character array */
 int sprintf(char *buf, const char *fmt, ...) {
-     // Note the usual problem with buffer overflow
-    char *p = buf;
+    // Note the usual problem with buffer overflow
     va_list va;
+    int n;
+
     va_start(va, fmt);
-    _do_print(f_storec, (void *) &p, fmt, va);
+    n = str_print(buf, NULL, fmt, va);
     va_end(va);
-    *p++ = '\0';
-    return (p - buf);
+    return n;
 }
@@ -35,12 +35,23 @@
 /* do_print -- the device-independent guts of printf */
 void do_print(void (*putch)(char), const char *fmt, va_list va);
 
-/* _do_print -- the same with more guts showing */
-void _do_print(void (*f)(void *, char), void *p, const char *fmt, va_list va);
+/* The formats understood are %c, %d, %s, %u and %x, where %x adds 0x
+   to non-zero values.  Each may have flags - (left justify) and 0
+   (pad with zeros), then a field width, then l for a long argument. */
+
+/* _do_print -- the same with more guts showing: output is passed to f
+   with parameter p a chunk at a time */
+void _do_print(void (*f)(void *, const char *, int), void *p,
+               const char *fmt, va_list va);
 
 /* sprintf -- print to string buffer.  Note danger of overflow! */
 int sprintf(char *buf, const char *fmt, ...);
 
+/* snprintf -- print at most size-1 characters and a null; return the
+   length the whole output would have had */
+int snprintf(char *buf, unsigned size, const char *fmt, ...);
+int vsnprintf(char *buf, unsigned size, const char *fmt, va_list va);
+
 /* atoi -- convert decimal string to int */
 int atoi(const char *p);
 
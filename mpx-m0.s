@@ -92,14 +92,34 @@ irestore:                       @ Expect process sp in r0
         bx lr
 
 @@@ svc_handler -- handler for SVC interrupt (system call)
+
+@@@ Most system calls return to the same process, and then there is no
+@@@ need to save and restore r4-r11 at all, because system_call obeys
+@@@ the calling convention and leaves them as it found them.  So we
+@@@ pass system_call the sp that isave would have produced, without
+@@@ saving anything, and complete the save only if it returns the sp
+@@@ of a different process.
         .global svc_handler
         .thumb_func
 svc_handler:
 	push {lr}               @ Push lr on main stack
-	bl isave                @ Complete saving of state
+	mrs r0, psp             @ Compute process sp as if after isave
+        subs r0, #32
         bl system_call          @ Perform system call
-        bl irestore             @ Restore manually saved state
-        pop {pc}                @ Return to new thread
+	mrs r1, psp             @ Same process as before?
+        subs r1, #32
+        cmp r0, r1
+        beq 1f                  @ If so, r4-r11 are intact
+        mov r2, r1              @ Otherwise save them in the old frame
+        adds r2, #16
+        stm r2!, {r4-r7}        @ Low regs
+	mov r4, r8
+        mov r5, r9
+        mov r6, r10
+        mov r7, r11
+        stm r1!, {r4-r7}        @ High regs
+        bl irestore             @ Restore state of new process
+1:      pop {pc}                @ Return to thread
 
 @@@ pendsv_handler -- handler for PendSV interupt (context switch)
         .global pendsv_handler
@@ -54,11 +54,75 @@ static void *sbrk(int inc) {
     return result;
 }
 
+/* Stacks of 256, 512, 1024 or 2048 bytes are allocated in size
+   classes, and the stack of a process that exits goes on a free list
+   for its class, ready to be used again by spawn().  Stacks are only
+   ever taken from sbrk() when the free list is empty, so allocation
+   and release take constant time, at the cost of rounding each
+   request up to the next class.  A free stack keeps the link to the
+   next in its lowest word. */
+
+#define NSCLASS 4               // Number of stack size classes
+#define SCLASS_MIN 256          // Smallest class: each is twice the last
+
+#define sclass_size(c) (SCLASS_MIN << (c))
+
+static void *stk_free[NSCLASS];  // Free list for each class
+static short stk_made[NSCLASS];  // Number of stacks taken from sbrk()
+static short stk_nfree[NSCLASS]; // Number on the free list
+
+/* sclass -- smallest class that will hold n bytes, or -1 */
+static int sclass(unsigned n) {
+    for (int c = 0; c < NSCLASS; c++) {
+        if (n <= sclass_size(c)) return c;
+    }
+
+    return -1;
+}
+
+/* stk_alloc -- allocate a stack of class c, or NULL if no memory */
+static void *stk_alloc(int c) {
+    void *s = stk_free[c];
+
+    if (s != NULL) {
+        stk_free[c] = *(void **) s;
+        stk_nfree[c]--;
+    } else {
+        if (sclass_size(c) > __stack_limit
+            - (unsigned char *) ROUNDUP((unsigned) __break, 8))
+            return NULL;
+        s = sbrk(sclass_size(c));
+        stk_made[c]++;
+    }
+
+    return s;
+}
+
+/* stk_release -- return a stack of class c to its free list */
+static void stk_release(void *s, int c) {
+    *(void **) s = stk_free[c];
+    stk_free[c] = s;
+    stk_nfree[c]++;
+}
+
 
 /* PROCESS TABLE */
 
 #define NPROCS 16
 
+#ifdef ENABLE_MAILBOX
+/* mailbox -- buffer for posted messages: see MAILBOXES below */
+struct mailbox {
+    message *mb_buf;            /* Array of slots */
+    unsigned short mb_size;     /* Number of slots */
+    unsigned short mb_count;    /* Number of messages held */
+    unsigned short mb_head;     /* Index of oldest message */
+    unsigned short mb_policy;   /* MB_BLOCK, MB_DROP or MB_FAIL */
+    unsigned short mb_hiwater;  /* Largest count seen */
+    unsigned mb_dropped;        /* Messages discarded or refused */
+};
+#endif
+
 static struct proc {
      int p_pid;                  /* Process ID (equal to index) */
      char p_name[16];            /* Name for debugging */
@@ -66,14 +130,40 @@ static struct proc {
      unsigned *p_sp;             /* Saved stack pointer */
      void *p_stack;              /* Stack area */
      unsigned p_stksize;         /* Stack size (bytes) */
+     int p_sclass;               /* Stack size class, or -1 */
+     unsigned *p_scan;           /* Next word for watermark scan */
+     unsigned *p_mark;           /* Lowest stack word known to be used */
      int p_priority;             /* Priority: 0 is highest */
+     int p_basepri;              /* Priority without inheritance */
+#ifdef ENABLE_TIMESLICE
+     int p_quantum;              /* Time slice (ms), or 0 for none */
+#endif
+     unsigned p_preempts;        /* Number of times preempted */
+#ifdef ENABLE_ACCOUNTING
+     unsigned p_time;            /* Total run time (usec) */
+     unsigned p_window;          /* Run time in current window (usec) */
+     int p_load;                 /* Load in last window (per mille) */
+#endif
 
      struct proc *p_waiting;     /* Processes waiting to send */
+     struct proc *p_clients;     /* Processes awaiting our reply */
      int p_pending;              /* Whether HARDWARE message pending */
+     unsigned p_irqs;            /* Bitmap of IRQs that have fired */
+     unsigned p_notify;          /* Notification bits pending */
      int p_accept;               /* Processes who may send: ANY or pid */
      message *p_message;         /* Pointer to message buffer */
+#ifdef ENABLE_MAILBOX
+     struct mailbox *p_mbox;     /* Buffer for posted messages, or NULL */
+#endif
 #ifdef ENABLE_TIMEOUTS
      int p_timeout;              /* Timeout for recieve (ms) or NO_TIME */
+     unsigned p_due;             /* Time when the timeout is due */
+     struct proc *p_tnext;       /* Next process in timeout list */
+     struct proc **p_tprev;      /* Pointer that points to this process */
+     int p_period;               /* Period for wait_next_period (ms) or 0 */
+     int p_anchored;             /* Whether p_release is known */
+     unsigned p_release;         /* Time of the latest release */
+     unsigned p_missed;          /* Number of release times missed */
 #endif
 
      struct proc *p_next;        /* Next process in ready or send queue */
@@ -86,6 +176,8 @@ static struct proc {
 #define RECEIVING 3
 #define BOTH 4
 #define IDLING 5
+#define SLEEPING 6              // In sleep()
+#define PERIODIC 7              // In wait_next_period()
 
 #ifdef ENABLE_TIMEOUTS
 #define NO_TIME 0x80000000
@@ -94,48 +186,508 @@ static struct proc {
 static struct proc *current;
 static struct proc *idle_proc;
 
+static unsigned idle_wakeups = 0; /* Times the idle process has woken */
+
 #define BLANK 0xdeadbeef        /* Filler for initial stack */
 
 static void kprintf_setup(void);
 static void kprintf_internal(char *fmt, ...);
 
+
+/* BLOCK POOLS */
+
+/* Applications can create pools of fixed-size blocks at init
+   time, using the same space as stacks.  Each pool keeps a free list
+   linked through the first word of each free block, so pool_alloc()
+   and pool_free() take constant time.  A bitmap records which blocks
+   are allocated, so that pool_free() can catch a block freed twice.  They do their work with
+   interrupts disabled, and restore the previous setting afterwards,
+   so they may be called from any process or interrupt handler without
+   going through the kernel, and also between lock() and unlock(). */
+
+struct pool {
+    char *pl_name;              /* Name for dump */
+    void *pl_free;              /* Free list */
+    unsigned char *pl_base;     /* First block */
+    unsigned char *pl_limit;    /* End of last block */
+    unsigned short pl_size;     /* Block size (bytes) */
+    unsigned short pl_nblocks;  /* Number of blocks */
+    unsigned short pl_inuse;    /* Number allocated */
+    unsigned short pl_hiwater;  /* Most ever allocated */
+    unsigned *pl_map;           /* Bit for each block that is in use */
+    unsigned pl_failed;         /* Allocations that found pool empty */
+    struct pool *pl_next;       /* Next pool, for dump */
+};
+
+static struct pool *pools = NULL;
+
+/* pool_create -- allocate a pool of n blocks */
+pool *pool_create(char *name, int size, int n) {
+    if (current != NULL)
+        panic("pool_create() called after scheduler startup");
+
+    if (size <= 0 || n <= 0) panic("Bad pool parameters");
+
+    struct pool *pl = sbrk(sizeof(struct pool));
+    size = ROUNDUP(size, 4);
+    pl->pl_name = name;
+    pl->pl_base = sbrk(size * n);
+    pl->pl_limit = pl->pl_base + size * n;
+    pl->pl_size = size;
+    pl->pl_nblocks = n;
+    pl->pl_inuse = pl->pl_hiwater = 0;
+    pl->pl_failed = 0;
+    pl->pl_map = sbrk(4 * ((n+31)/32));
+    for (int i = 0; i < (n+31)/32; i++) pl->pl_map[i] = 0;
+
+    // Thread the free list through the blocks, first block first
+    pl->pl_free = NULL;
+    for (unsigned char *b = pl->pl_limit - size; b >= pl->pl_base; b -= size) {
+        *(void **) b = pl->pl_free;
+        pl->pl_free = b;
+    }
+
+    pl->pl_next = pools;
+    pools = pl;
+    return pl;
+}
+
+/* pool_alloc -- allocate a block */
+void *pool_alloc(pool *pl) {
+    unsigned mask;
+    void *b;
+
+    intr_save(mask);
+    b = pl->pl_free;
+    if (b == NULL)
+        pl->pl_failed++;
+    else {
+        int i = ((unsigned char *) b - pl->pl_base) / pl->pl_size;
+        pl->pl_map[i/32] |= BIT(i%32);
+        pl->pl_free = *(void **) b;
+        if (++pl->pl_inuse > pl->pl_hiwater)
+            pl->pl_hiwater = pl->pl_inuse;
+    }
+    intr_restore(mask);
+
+    return b;
+}
+
+/* pool_free -- free a block */
+void pool_free(pool *pl, void *blk) {
+    unsigned char *b = blk;
+    unsigned mask, bit;
+    int i, used;
+
+    if (b < pl->pl_base || b >= pl->pl_limit
+        || (b - pl->pl_base) % pl->pl_size != 0)
+        panic("Freeing bad block %x to pool %s", (unsigned) b, pl->pl_name);
+
+    i = (b - pl->pl_base) / pl->pl_size;
+    bit = BIT(i%32);
+
+    intr_save(mask);
+    used = ((pl->pl_map[i/32] & bit) != 0);
+    if (used) {
+        pl->pl_map[i/32] &= ~bit;
+        *(void **) b = pl->pl_free;
+        pl->pl_free = b;
+        pl->pl_inuse--;
+    }
+    intr_restore(mask);
+
+    if (! used)
+        panic("Block %x freed twice to pool %s", (unsigned) b, pl->pl_name);
+}
+
+/* pool_stats -- fetch statistics for a pool */
+void pool_stats(pool *pl, int *inuse, int *hiwater, int *failed) {
+    *inuse = pl->pl_inuse;
+    *hiwater = pl->pl_hiwater;
+    *failed = pl->pl_failed;
+}
+
+
+/* STACK CHECKING */
+
+/* Each stack is filled with BLANK when it is created, and the lowest
+   word acts as a canary: whenever a process enters the kernel, we
+   check that its saved sp is above the canary and the canary is still
+   intact, and panic if not.  That catches most overflows before they
+   can do much damage to the neighbouring stack.
+
+   The idle process also keeps track of how much of each stack has
+   been used, by looking for the lowest word that is not BLANK.  It
+   does this a few words at a time after each wakeup, working on each
+   stack in turn, including the kernel stack.  For each stack, p_mark
+   is the lowest word known to be used, and p_scan moves up from the
+   bottom towards it; when it finds a word that is in use, that
+   becomes the new mark, and the scan starts again from the bottom. */
+
+extern unsigned __stack[];
+
+#define STK_SAMPLE 16           // Words to look at after each wakeup
+
+static unsigned *kstk_scan, *kstk_mark; // Same for the kernel stack
+
+/* check_stack -- panic if the current process has overflowed */
+static inline void check_stack(unsigned *psp) {
+    unsigned *base = (unsigned *) current->p_stack;
+    if (psp <= base || *base != BLANK)
+        panic("Stack overflow in process %s", current->p_name);
+}
+
+/* kstk_init -- fill the unused part of the kernel stack */
+static void kstk_init(void) {
+    // Leave a margin below our own frame
+    unsigned *top = (unsigned *) __builtin_frame_address(0) - 16;
+    for (unsigned *p = (unsigned *) __stack_limit; p < top; p++)
+        *p = BLANK;
+    kstk_scan = (unsigned *) __stack_limit;
+    kstk_mark = top;
+}
+
+/* sample -- advance the watermark scan of a stack by up to n words */
+static void sample(unsigned *base, unsigned **scan, unsigned **mark, int n) {
+    unsigned *s = *scan;
+
+    for (; n > 0; n--) {
+        if (s >= *mark)
+            s = base;           // Finished a pass: start again
+        else if (*s != BLANK) {
+            *mark = s;          // New low-water mark
+            s = base;
+        }
+        else
+            s++;
+    }
+
+    *scan = s;
+}
+
+static int sample_pid = 0;      // Next stack to sample: NPROCS for kernel
+
+/* sample_stacks -- do a little of the watermark scan */
+static void sample_stacks(void) {
+    if (sample_pid == NPROCS)
+        sample((unsigned *) __stack_limit, &kstk_scan, &kstk_mark,
+               STK_SAMPLE);
+    else {
+        struct proc *p = &ptable[sample_pid];
+        if (p->p_state != DEAD)
+            sample((unsigned *) p->p_stack, &p->p_scan, &p->p_mark,
+                   STK_SAMPLE);
+    }
+
+    if (++sample_pid > NPROCS) sample_pid = 0;
+}
+
+/* stack_used -- report the high-water mark for a stack */
+int stack_used(int pid) {
+    if (pid == HARDWARE)
+        return (char *) __stack - (char *) kstk_mark;
+
+    if (pid < 0 || pid >= NPROCS || ptable[pid].p_state == DEAD)
+        panic("Stack of non-existent process %d", pid);
+
+    struct proc *p = &ptable[pid];
+    return (char *) p->p_stack + p->p_stksize - (char *) p->p_mark;
+}
+
+
+#if defined(ENABLE_ACCOUNTING) || defined(ENABLE_TRACE)
+/* MICROSECOND CLOCK */
+
+/* For accounting and tracing, TIMER0 runs freely at 1MHz.  It is read
+   by triggering a capture, and each use has its own capture channel,
+   so that an interrupt handler cannot spoil a reading made by the
+   kernel: CC[1] for tracing, CC[2] for accounting in handlers and
+   CC[3] for accounting in the kernel.  CC[0] is free for other uses
+   of the same clock, such as the microsecond timers in timer.c, which
+   share CC[1] for reading it with interrupts disabled. */
+
+/* usec_clock -- read the clock using capture channel cc */
+static inline unsigned usec_clock(int cc) {
+    TIMER0_CAPTURE[cc] = 1;
+    return TIMER0_CC[cc];
+}
+
+/* usec_init -- start the clock */
+static void usec_init(void) {
+    TIMER0_STOP = 1;
+    TIMER0_MODE = TIMER_Mode_Timer;
+    TIMER0_BITMODE = TIMER_32Bit;
+    TIMER0_PRESCALER = 4;       // 1MHz = 16MHz / 2^4
+    TIMER0_CLEAR = 1;
+    TIMER0_START = 1;
+}
+#endif
+
+
+#ifdef ENABLE_ACCOUNTING
+/* CPU ACCOUNTING */
+
+/* The clock is sampled each time the kernel is entered by a system
+   call or a preemption.  The time since the previous sample, less any
+   time spent in interrupt handlers, is charged to the process that
+   was running -- the idle process if there was nothing to do.  Time
+   in handlers is measured by phos_interrupt() and charged to
+   HARDWARE.  Each second, the time in the window just ended becomes
+   the load of each process. */
+
+#define WINDOW 1000000          // Length of load window (usec)
+
+static unsigned acct_last;      // Time of last sample
+static unsigned acct_start;     // Start of current window
+static unsigned irq_recent;     // Handler time since last sample
+static unsigned irq_time, irq_window; // Handler time, total and in window
+static int irq_load;            // Handler load in last window
+
+/* end_window -- compute loads for the window just ended */
+static void end_window(unsigned now) {
+    unsigned len = (now - acct_start) / 1000;
+
+    for (int pid = 0; pid < NPROCS; pid++) {
+        struct proc *p = &ptable[pid];
+        p->p_load = p->p_window / len;
+        p->p_window = 0;
+    }
+
+    irq_load = irq_window / len;
+    irq_window = 0;
+    acct_start = now;
+}
+
+/* charge -- charge time since the last sample to current */
+static void charge(void) {
+    intr_disable();
+    unsigned now = usec_clock(3);
+    unsigned d = now - acct_last - irq_recent;
+    acct_last = now;
+    irq_recent = 0;
+    intr_enable();
+
+    current->p_time += d;
+    current->p_window += d;
+
+    if (now - acct_start >= WINDOW)
+        end_window(now);
+}
+
+/* charge_irq -- charge time since start to interrupt handlers */
+static void charge_irq(unsigned start) {
+    unsigned d = usec_clock(2) - start;
+    irq_recent += d;
+    irq_time += d;
+    irq_window += d;
+}
+
+/* mini_cpuload -- fetch load and total time for a process */
+static int mini_cpuload(int pid, unsigned *usec) {
+    if (pid == HARDWARE) {
+        if (usec != NULL) *usec = irq_time;
+        return irq_load;
+    }
+
+    if (pid < 0 || pid >= NPROCS || ptable[pid].p_state == DEAD)
+        panic("Load of non-existent process %d", pid);
+
+    struct proc *p = &ptable[pid];
+    if (usec != NULL) *usec = p->p_time;
+    return p->p_load;
+}
+
+/* show_load -- print a line of the load table */
+static void show_load(int load, unsigned time, char *name) {
+    char buf[16];
+
+    sprintf(buf, "%d.%d%%", load/10, load%10);
+    kprintf_internal("%7s %ums %s\r\n", buf, time/1000, name);
+}
+
+/* load_dump -- show a table of processes by load in the last window */
+static void load_dump(void) {
+    unsigned shown = 0;
+
+    kprintf_internal("\r\n   %%CPU TIME NAME\r\n");
+    show_load(irq_load, irq_time, "(interrupts)");
+
+    // Selection sort, with shown as the set of pids already printed
+    while (1) {
+        struct proc *best = NULL;
+
+        for (int pid = 0; pid < NPROCS; pid++) {
+            struct proc *p = &ptable[pid];
+            if (p->p_state != DEAD && ! (shown & BIT(pid))
+                && (best == NULL || p->p_load > best->p_load))
+                best = p;
+        }
+
+        if (best == NULL) break;
+        shown |= BIT(best->p_pid);
+        show_load(best->p_load, best->p_time, best->p_name);
+    }
+}
+#endif
+
+
+#ifdef ENABLE_TRACE
+/* EVENT TRACING */
+
+/* The kernel can keep a record of recent events in a ring buffer:
+   context switches, message passing, interrupts and timeouts.  Each
+   record is 8 bytes: a timestamp in usec, an event code, the process
+   concerned, and two bytes whose meaning depends on the event.  When
+   the ring is full, the oldest record is overwritten.  The serial
+   task drains the buffer when CTRL-T is typed, and tools/trace2json.py
+   turns the result into a trace for chrome://tracing or Perfetto.
+   Records are written from the kernel and from interrupt handlers
+   without disabling interrupts, on the assumption that handlers
+   cannot preempt each other or the kernel. */
+
+#define NTRACE 128              // Records in the ring (a power of 2)
+
+/* Event codes: keep them in step with tools/trace2json.py */
+#define TR_SWITCH 1             // Process pid starts running
+#define TR_SEND 2               // pid sends message type to arg
+#define TR_SENDREC 3            // pid calls arg with message type
+#define TR_RECEIVE 4            // pid receives from arg
+#define TR_NOTIFY 5             // pid notifies arg with bits type
+#define TR_INTR 6               // IRQ arg for handler pid
+#define TR_TIMEOUT 7            // Timeout for pid
+
+#define TR_ANY 0xfe             // Byte code for ANY
+
+static struct trace {
+    unsigned t_time;            /* Timestamp (usec) */
+    byte t_event;               /* Event code */
+    byte t_pid;                 /* Process concerned */
+    byte t_arg;                 /* Other process or IRQ */
+    byte t_type;                /* Message type or other detail */
+} trace_buf[NTRACE];
+
+static unsigned trace_in = 0;   // Count of records written
+static unsigned trace_out = 0;  // Count of records read
+static int trace_frozen = 0;    // Whether tracing is suspended
+
+/* trace -- add a record to the ring */
+static inline void trace(int event, int pid, int arg, int type) {
+    if (trace_frozen) return;
+
+    struct trace *r = &trace_buf[trace_in & (NTRACE-1)];
+    r->t_time = usec_clock(1);
+    r->t_event = event;
+    r->t_pid = pid;
+    r->t_arg = (arg == ANY ? TR_ANY : arg);
+    r->t_type = type;
+
+    if (++trace_in - trace_out > NTRACE)
+        trace_out = trace_in - NTRACE; // Lose the oldest record
+}
+
+/* trace_get -- copy out the oldest record */
+int trace_get(unsigned rec[2]) {
+    int ok = 0;
+
+    intr_disable();
+    if (trace_out != trace_in) {
+        memcpy(rec, &trace_buf[trace_out & (NTRACE-1)], 8);
+        trace_out++;
+        ok = 1;
+    }
+    intr_enable();
+
+    return ok;
+}
+
+/* trace_freeze -- suspend tracing while the buffer is read */
+void trace_freeze(int freeze) {
+    trace_frozen = freeze;
+}
+#else
+#define trace(event, pid, arg, type)
+#endif
+
+
+#ifdef ENABLE_TIMESLICE
+static void start_slice(void);
+#endif
+static void intr_message(struct proc *p, message *m);
+
 /* phos_dump -- display process states */
 static void phos_dump(void) {
-    char *status = "ZASRBI";
-    char buf1[16], buf2[16];
+    char *status = "ZASRBIWP";
+    char buf[16];
 
     kprintf_setup();
     kprintf_internal("\r\nPROCESS DUMP\r\n");
 
-    // Our version of printf is a bit feeble, so the following is
-    // rather painful.
-
     for (int pid = 0; pid < NPROCS; pid++) {
         struct proc *p = &ptable[pid];
 
         if (*p->p_name != '\0') {
-            unsigned *z = (unsigned *) p->p_stack;
-            while (*z == BLANK) z++;
-            unsigned free = (char *) z - (char *) p->p_stack;
-
-            if (pid < 10)
-                sprintf(buf1, " %d", pid);
-            else
-                sprintf(buf1, "%d", pid);
-
-            sprintf(buf2, "%u/%u", p->p_stksize-free, p->p_stksize);
-            int w = strlen(buf2);
-            if (w < 9) {
-                memset(buf2+w, ' ', 9-w);
-                buf2[9] = '\0';
-            }
-
-            kprintf_internal("%s: [%c] %x stk=%s %s\r\n",
-                             buf1, status[p->p_state],
+            // Finish the watermark scan, since we have time to spare
+            if (p->p_state != DEAD)
+                sample((unsigned *) p->p_stack, &p->p_scan, &p->p_mark,
+                       p->p_stksize/4 + 1);
+            unsigned used = (char *) p->p_stack + p->p_stksize
+                - (char *) p->p_mark;
+
+            sprintf(buf, "%u/%u", used, p->p_stksize);
+            kprintf_internal("%2d: [%c] pri=%2d %x stk=%-9s pre=%u %s\r\n",
+                             pid, status[p->p_state], p->p_priority,
                              (unsigned) p->p_stack,
-                             buf2, p->p_name);
+                             buf, p->p_preempts, p->p_name);
         }
     }
+
+#ifdef ENABLE_MAILBOX
+    for (int pid = 0; pid < NPROCS; pid++) {
+        struct mailbox *mb = ptable[pid].p_mbox;
+
+        if (mb != NULL)
+            kprintf_internal("Mailbox %d: %d/%d hiwater=%d dropped=%u\r\n",
+                             pid, mb->mb_count, mb->mb_size,
+                             mb->mb_hiwater, mb->mb_dropped);
+    }
+#endif
+
+#ifdef ENABLE_TIMEOUTS
+    for (int pid = 0; pid < NPROCS; pid++) {
+        struct proc *p = &ptable[pid];
+
+        if (p->p_period > 0)
+            kprintf_internal("Period %d: %dms missed=%u\r\n",
+                             pid, p->p_period, p->p_missed);
+    }
+#endif
+
+    for (struct pool *pl = pools; pl != NULL; pl = pl->pl_next)
+        kprintf_internal("Pool %s: %dx%d inuse=%d hiwater=%d failed=%u\r\n",
+                         pl->pl_name, pl->pl_nblocks, pl->pl_size,
+                         pl->pl_inuse, pl->pl_hiwater, pl->pl_failed);
+
+    // Stacks on the free lists can only be reused for the same class
+    unsigned pooled = 0;
+    kprintf_internal("Stacks (free/made):");
+    for (int c = 0; c < NSCLASS; c++) {
+        kprintf_internal(" %d=%d/%d", sclass_size(c),
+                         stk_nfree[c], stk_made[c]);
+        pooled += stk_nfree[c] * sclass_size(c);
+    }
+    kprintf_internal("\r\nPooled %u bytes, unallocated %u bytes\r\n",
+                     pooled, (unsigned) (__stack_limit - __break));
+
+#ifdef ENABLE_ACCOUNTING
+    load_dump();
+#endif
+
+    sample((unsigned *) __stack_limit, &kstk_scan, &kstk_mark,
+           (__stack - (unsigned *) __stack_limit) + 1);
+    kprintf_internal("Kernel stack: %d/%d\r\n", stack_used(HARDWARE),
+                     (char *) __stack - (char *) __stack_limit);
+
+    kprintf_internal("Idle wakeups: %u\r\n", idle_wakeups);
 }
 
 
@@ -144,7 +696,26 @@ static void phos_dump(void) {
 /* ready_q -- one queue for each priority */
 static struct queue {
     struct proc *q_head, *q_tail;
-} ready_q[3];
+} ready_q[NPRIO];
+
+#if NPRIO > 32
+#error "At most 32 priority levels are supported"
+#endif
+
+/* ready_map -- bit i is set if ready_q[i] is non-empty */
+static unsigned ready_map = 0;
+
+/* The Cortex-M0 has no CLZ instruction, so we find the lowest set bit
+   of ready_map (the highest priority that is ready) by isolating it
+   with x & -x, then multiplying by a de Bruijn sequence so that the
+   top five bits of the product index a table of bit numbers.  That
+   takes constant time however many levels there are. */
+static const unsigned char debruijn[32] = {
+     0,  1, 28,  2, 29, 14, 24,  3, 30, 22, 20, 15, 25, 17,  4,  8,
+    31, 27, 13, 23, 21, 19, 16,  7, 26, 12, 18,  6, 11,  5, 10,  9
+};
+
+#define lowbit(x) debruijn[(((x) & -(x)) * 0x077cb531) >> 27]
 
 /* make_ready -- add process to end of appropriate queue */
 static void make_ready(struct proc *p) {
@@ -155,107 +726,604 @@ static void make_ready(struct proc *p) {
 
     struct queue *q = &ready_q[p->p_priority];
 
-    if (q->q_head == NULL)
+    if (q->q_head == NULL) {
         q->q_head = p;
-    else
+        ready_map |= BIT(p->p_priority);
+    } else
         q->q_tail->p_next = p;
      
     q->q_tail = p;
 }
 
+/* unready -- remove a ready process from its queue */
+static void unready(struct proc *p) {
+    struct queue *q = &ready_q[p->p_priority];
+    struct proc *prev = NULL;
+
+    for (struct proc *r = q->q_head; r != p; r = r->p_next)
+        prev = r;
+
+    if (prev == NULL)
+        q->q_head = p->p_next;
+    else
+        prev->p_next = p->p_next;
+
+    if (q->q_tail == p)
+        q->q_tail = prev;
+    if (q->q_head == NULL)
+        ready_map &= ~BIT(p->p_priority);
+}
+
 /* choose_proc -- pick a new process as current */
 static void choose_proc(void) {
-    for (int p = 0; p < 3; p++) {
+    if (ready_map == 0)
+        current = idle_proc;
+    else {
+        int p = lowbit(ready_map);
         struct queue *q = &ready_q[p];
-        if (q->q_head != NULL) {
-            current = q->q_head;
-            q->q_head = current->p_next;
-            return;
+        current = q->q_head;
+        q->q_head = current->p_next;
+        if (q->q_head == NULL)
+            ready_map &= ~BIT(p);
+    }
+
+#ifdef ENABLE_TIMESLICE
+    start_slice();
+#endif
+    trace(TR_SWITCH, current->p_pid, 0, 0);
+}
+
+/* When a client calls a waiting server with sendrec(), or a server
+   replies to a waiting client, there is no need to put the partner
+   on the back of its ready queue and then find it again: we can
+   switch to it directly, provided nothing more urgent is ready.  The
+   partner gets a time slice of its own, as if choose_proc() had
+   picked it, so a server with no quantum is not preempted for the
+   client's. */
+
+/* can_handoff -- test if no ready process has priority above p */
+#define can_handoff(p) ((ready_map & (BIT((p)->p_priority)-1)) == 0)
+
+/* handoff -- make p current without going through the ready queue */
+static inline void handoff(struct proc *p) {
+    p->p_state = READY;
+    current = p;
+#ifdef ENABLE_TIMESLICE
+    start_slice();
+#endif
+    trace(TR_SWITCH, p->p_pid, 0, 0);
+}
+
+
+/* PRIORITY INHERITANCE */
+
+/* A process that is blocked on a server -- either queued to send to
+   it, or waiting for the reply to sendrec -- lends the server its
+   priority, so a P_HIGH client is not kept waiting while the server
+   is outrun by P_LOW processes.  The effective priority p_priority of
+   each process is thus the highest of its own p_basepri and the
+   priorities of the processes blocked on it.  Lending happens as soon
+   as a client blocks; the loan is recalled lazily when the server
+   next replies or asks for another message.  Only one level of
+   lending is done: if the server is itself blocked on another
+   process, that process does not inherit.  Clients waiting for a
+   reply are kept on the server's p_clients list, linked through
+   p_next, so the lenders are all found from the server itself.  With
+   ENABLE_PRIOWAIT, a process that inherits while it is waiting to send
+   is moved to its new place in the queue. */
+
+/* join -- add p to the queue of processes waiting to send to pdst */
+static void join(struct proc *pdst, struct proc *p) {
+    struct proc **r = &pdst->p_waiting;
+
+#ifdef ENABLE_PRIOWAIT
+    // Keep the queue in priority order, and FIFO within each level
+    while (*r != NULL && (*r)->p_priority <= p->p_priority)
+        r = &(*r)->p_next;
+#else
+    while (*r != NULL)
+        r = &(*r)->p_next;
+#endif
+
+    p->p_next = *r;
+    *r = p;
+}
+
+/* inherit -- lend the priority of the current process to p */
+static void inherit(struct proc *p) {
+    if (current->p_priority >= p->p_priority) return;
+
+    if (p->p_state == READY && p != current) {
+        // Move p to the queue for its new priority
+        unready(p);
+        p->p_priority = current->p_priority;
+        make_ready(p);
+    } else {
+        p->p_priority = current->p_priority;
+
+#ifdef ENABLE_PRIOWAIT
+        if (p->p_state == SENDING || p->p_state == BOTH) {
+            // p is itself waiting to send: move it up its queue
+            struct proc *pdst = &ptable[p->p_accept], **r;
+
+            for (r = &pdst->p_waiting; *r != p; r = &(*r)->p_next) { }
+            *r = p->p_next;
+            join(pdst, p);
         }
+#endif
     }
+}
 
-    current = idle_proc;
+/* disinherit -- recompute the priority of current; true if it fell */
+static int disinherit(void) {
+    int prio = current->p_basepri;
+
+    if (current->p_priority == prio)
+        return 0;
+
+    for (struct proc *r = current->p_waiting; r != NULL; r = r->p_next) {
+        if (r->p_priority < prio) prio = r->p_priority;
+    }
+
+    for (struct proc *r = current->p_clients; r != NULL; r = r->p_next) {
+        if (r->p_priority < prio) prio = r->p_priority;
+    }
+
+    if (prio == current->p_priority)
+        return 0;
+
+    current->p_priority = prio;
+    return 1;
+}
+
+/* give_way -- let a more urgent process run after a loan is recalled */
+static void give_way(void) {
+    if (! can_handoff(current)) {
+        make_ready(current);
+        choose_proc();
+    }
+}
+
+/* await_reply -- make p wait for a reply from server s */
+static void await_reply(struct proc *p, struct proc *s) {
+    p->p_state = RECEIVING;
+    p->p_next = s->p_clients;
+    s->p_clients = p;
+}
+
+/* replied -- remove p from the clients of current, if it is there */
+static void replied(struct proc *p) {
+    struct proc **r = &current->p_clients;
+
+    while (*r != NULL && *r != p)
+        r = &(*r)->p_next;
+
+    if (*r != NULL)
+        *r = p->p_next;
 }
 
+/* enqueue -- make current wait to send to pdst */
+static void enqueue(struct proc *pdst) {
+    // p_accept records where a sender waits, as well as whom a
+    // receiver will accept
+    current->p_accept = pdst->p_pid;
+    join(pdst, current);
+    inherit(pdst);
+}
+
+
+#ifdef ENABLE_TIMESLICE
+/* TIME SLICING */
+
+/* A process that has set a quantum with quantum(ms) is preempted when
+   it has run for that long, provided another process with the same
+   priority is ready; it then goes to the back of its queue.  The
+   slice is timed by TIMER2 in one-shot mode, and restarted whenever
+   choose_proc() picks a process.  The preemption itself is done by
+   the PendSV handler, just as for interrupts. */
+
+#define SLICE_MAX 500           // Longest quantum for 16-bit timer (ms)
+
+/* slice_init -- set up TIMER2 for time slicing */
+static void slice_init(void) {
+    TIMER2_STOP = 1;
+    TIMER2_MODE = TIMER_Mode_Timer;
+    TIMER2_BITMODE = TIMER_16Bit;
+    TIMER2_PRESCALER = 7;       // 125kHz = 16MHz / 2^7
+    TIMER2_CLEAR = 1;
+    TIMER2_SHORTS = BIT(TIMER_COMPARE0_CLEAR) | BIT(TIMER_COMPARE0_STOP);
+    TIMER2_INTENSET = BIT(TIMER_INT_COMPARE0);
+    enable_irq(TIMER2_IRQ);
+}
+
+/* start_slice -- start a fresh time slice for current */
+static void start_slice(void) {
+    TIMER2_STOP = 1;
+    TIMER2_CLEAR = 1;
+    if (current->p_quantum > 0) {
+        TIMER2_CC[0] = 125 * current->p_quantum;
+        TIMER2_START = 1;
+    }
+}
+
+/* timer2_handler -- end of time slice */
+void timer2_handler(void) {
+    TIMER2_COMPARE[0] = 0;
+
+    if (ready_q[current->p_priority].q_head != NULL)
+        reschedule();           // Another process deserves a turn
+    else if (current->p_quantum > 0)
+        TIMER2_START = 1;       // Carry on for another slice
+}
+
+/* quantum -- set time slice for current process, or 0 for none */
+void quantum(int ms) {
+    if (ms < 0 || ms > SLICE_MAX) panic("Bad quantum %d", ms);
+    current->p_quantum = ms;
+    start_slice();
+}
+#endif
+
 
 #ifdef ENABLE_TIMEOUTS
 /* TIMEOUTS */
 
-/* A process p has a timeout set if p->p_timeout != NO_TIME.  Those
-   processes are also in the array timeout, so we can find them
-   quickly on each tick. */
-
-static struct proc *timeout[NPROCS];
-static int n_timeouts = 0;
+/* A process p has a timeout set if p->p_timeout != NO_TIME.  The
+   kernel keeps a monotonic clock time_now in milliseconds, advanced
+   by each call of tick(), and each timeout that is counting has an
+   absolute due time p_due on that clock.  Timeouts live in a hashed
+   timing wheel: slot i holds a list of the timeouts that are due in
+   some period of 8ms whose number is congruent to i modulo the
+   number of slots.  Each slot is kept in order of due time, so each
+   tick looks only at the slots for the time that has passed, and in
+   each of them only at the timeouts that are due and the first one
+   that is not.  Cancelling a timeout takes constant time, and setting
+   one takes time proportional to the number already in its slot,
+   which is small unless many timeouts are due close together.
+   Because the head of each slot is its earliest timeout, the next due
+   time can be found by looking at the NWHEEL heads alone.
+
+   The kernel learns about the passage of time only when the timer
+   task calls tick(), and in tickless mode that may be a long time
+   after the previous call.  So a new timeout is not given a due time
+   straight away: it waits on the list time_fresh and starts counting
+   at the next tick.  That way, there is no risk of the timeout coming
+   too soon if a tick happens just after the timeout is set.  While it
+   waits, p_timeout holds the number of ms requested; once it is
+   counting, p_timeout is zero and p_due holds the due time. */
+
+#define NWHEEL 32               // Number of slots (a power of 2)
+#define WHEEL_SHIFT 3           // Each slot covers 2^3 = 8ms
+
+#define slot(t) ((t) >> WHEEL_SHIFT)
+
+static struct proc *wheel[NWHEEL]; // Timeouts that are counting
+static int n_armed = 0;          // Number of timeouts in the wheel
+static struct proc *time_fresh;  // Timeouts that start at next tick
+
+static unsigned time_now = 0;    // Monotonic clock (ms)
+static unsigned time_next;       // Earliest due time, if n_armed > 0
+
+/* before -- test if time t1 is earlier than t2, allowing for wrap */
+#define before(t1, t2) ((int) ((t1) - (t2)) < 0)
+
+/* link -- add p to a timeout list */
+static void link(struct proc *p, struct proc **list) {
+     p->p_tnext = *list;
+     if (*list != NULL) (*list)->p_tprev = &p->p_tnext;
+     p->p_tprev = list;
+     *list = p;
+}
 
-static int time_clock = 0;      // Accumulated ticks
-static int time_next = NO_TIME; // Earliest timeout due (could be -ve)
+/* unlink -- remove p from whatever timeout list it is on */
+static void unlink(struct proc *p) {
+     *(p->p_tprev) = p->p_tnext;
+     if (p->p_tnext != NULL) p->p_tnext->p_tprev = p->p_tprev;
+}
 
 static void set_timeout(int ms) {
-     int due = time_clock + ms;
-
-     assert(n_timeouts < NPROCS);
      assert(current->p_timeout == NO_TIME);
 
-     current->p_timeout = due;
-     timeout[n_timeouts++] = current;
+     current->p_timeout = ms;
+     link(current, &time_fresh);
 
-     if (time_next == NO_TIME || due < time_next)
-          time_next = due;
+#ifdef ENABLE_TICKLESS
+     // The timer task may be asleep until long after the timeout is due
+     interrupt(TIMER);
+#endif
 }
 
 static void cancel_timeout(struct proc *p) {
+     /* This may leave time_next too early, but that just means an
+        extra wakeup in tickless mode. */
+     unlink(p);
+     if (p->p_timeout == 0) n_armed--;
      p->p_timeout = NO_TIME;
+}
+
+/* arm -- start a timeout counting towards a due time */
+static void arm(struct proc *p, unsigned due) {
+     struct proc **list = &wheel[slot(due) & (NWHEEL-1)];
+
+     p->p_timeout = 0;
+     p->p_due = due;
+
+     // Keep the slot in order of due time, FIFO for equal times
+     while (*list != NULL && ! before(due, (*list)->p_due))
+          list = &(*list)->p_tnext;
+     link(p, list);
+
+     if (n_armed++ == 0 || before(due, time_next))
+          time_next = due;
+}
+
+/* find_next -- recompute time_next, given that n_armed > 0 */
+static void find_next(void) {
+     int first = 1;
+
+     // The earliest timeout in each slot is at its head
+     for (int i = 0; i < NWHEEL; i++) {
+          struct proc *p = wheel[i];
+          if (p != NULL && (first || before(p->p_due, time_next))) {
+               time_next = p->p_due;
+               first = 0;
+          }
+     }
+}
 
-     // Delete p from the timeout array
-     for (int i = 0; i < n_timeouts; i++) {
-          if (timeout[i] == p) {
-               timeout[i] = timeout[--n_timeouts];
-               return;
+/* expire -- deliver any timeouts that are due by time_now */
+static void expire(unsigned s) {
+     /* Note that timeouts are delivered as if from HARDWARE even if
+        the receive call specified another process. */
+
+     int expired = 0;
+
+     // Visit each slot for the time that has passed, but no slot twice
+     if (slot(time_now) - s >= NWHEEL)
+          s = slot(time_now) - (NWHEEL-1);
+
+     for (;;) {
+          struct proc **list = &wheel[s & (NWHEEL-1)], *pdst;
+
+          // The slot is in order, so stop at the first that is not due
+          while ((pdst = *list) != NULL && ! before(time_now, pdst->p_due)) {
+               cancel_timeout(pdst);
+               trace(TR_TIMEOUT, pdst->p_pid, 0, 0);
+               if (pdst->p_state == PERIODIC) {
+                    pdst->p_release = pdst->p_due;
+                    pdst->p_anchored = 1;
+               } else if (pdst->p_state != SLEEPING) {
+                    pdst->p_message->m_sender = HARDWARE;
+                    pdst->p_message->m_type = TIMEOUT;
+               }
+               make_ready(pdst);
+               expired = 1;
           }
+
+          if (s == slot(time_now)) break;
+          s++;
      }
 
-     panic("Cancelling a non-existent timeout");
+     if (n_armed > 0 && (expired || ! before(time_now, time_next)))
+          find_next();
 }
 
-void mini_tick(int delta) {
-     /* We delay delivery of timeouts until the clock tick after the
-        one where they expire. That way, there is no risk of the
-        timeout coming too soon if a tick happens just after the
-        timeout is set.  Note that timeouts are delivered as if from
-        HARDWARE even if the receive call specified another process. */
+/* mini_tick -- advance the clock; return ms to next timeout or -1 */
+static int mini_tick(int delta) {
+     unsigned s = slot(time_now);
+
+     time_now += delta;
 
-     int n = 0;                 // Number of surviving timeouts
+     if (n_armed > 0)
+          expire(s);
 
-     if (time_next == NO_TIME)
-          return;
-     else if (time_clock <= time_next) {
-          time_clock += delta;
-          return;
+     // Start new timeouts counting from now
+     while (time_fresh != NULL) {
+          struct proc *p = time_fresh;
+          unlink(p);
+          arm(p, time_now + p->p_timeout);
      }
-     
-     time_next = NO_TIME;
-
-     for (int j = 0; j < n_timeouts; j++) {
-          struct proc *pdst = timeout[j];
-          assert(pdst->p_timeout != NO_TIME);
-
-          if (pdst->p_timeout >= time_clock) {
-               pdst->p_timeout -= time_clock + delta;
-               if (time_next == NO_TIME || pdst->p_timeout < time_next)
-                    time_next = pdst->p_timeout;
-               timeout[n++] = pdst;
-          } else {
-               // Timeout already due.
-               pdst->p_timeout = NO_TIME;
-               pdst->p_message->m_sender = HARDWARE;
-               pdst->p_message->m_type = TIMEOUT;
-               make_ready(pdst);
-          }
-     }               
 
-     time_clock = 0;
-     n_timeouts = n;
+     return (n_armed > 0 ? time_next - time_now : -1);
+}
+
+/* A process can wait with sleep(ms) without a round trip to the timer
+   task: it enters the state SLEEPING with a timeout set, and expire()
+   makes it ready again.  A process that has set a period with
+   period(ms) can call wait_next_period() at the end of each cycle.
+   Its release times are p_release + k * p_period, counted from the
+   first release and not from each call, so they do not drift.  The
+   first call waits for one period from the next tick, like sleep().
+   If the next release time has already passed on the kernel's clock,
+   the process is not delayed, but continues from the latest release
+   time that has passed, and every release time that passed before the
+   call is counted in p_missed. */
+
+/* mini_sleep -- wait for ms milliseconds */
+static void mini_sleep(int ms) {
+     if (ms > 0) {
+          current->p_state = SLEEPING;
+          set_timeout(ms);
+     } else {
+          make_ready(current);
+     }
+
+     choose_proc();
+}
+
+/* mini_wait_period -- wait for next release; return periods missed */
+static int mini_wait_period(void) {
+     struct proc *p = current;
+     unsigned next;
+     int missed = 0;
+
+     if (p->p_period <= 0) panic("No period set");
+
+     if (! p->p_anchored) {
+          // Start the sequence of release times from the next tick
+          p->p_state = PERIODIC;
+          set_timeout(p->p_period);
+          choose_proc();
+          return 0;
+     }
+
+     // Only releases strictly in the past are missed: one due now
+     // is waited for like any other
+     next = p->p_release + p->p_period;
+     while (before(next, time_now)) {
+          p->p_release = next;
+          next += p->p_period;
+          missed++;
+     }
+
+     if (missed > 0) {
+          p->p_missed += missed;
+          return missed;
+     }
+
+     p->p_state = PERIODIC;
+     arm(p, next);
+#ifdef ENABLE_TICKLESS
+     interrupt(TIMER);
+#endif
+     choose_proc();
+     return 0;
+}
+
+/* period -- set period in ms for wait_next_period, or 0 for none */
+void period(int ms) {
+     if (ms < 0) panic("Bad period %d", ms);
+     current->p_period = ms;
+     current->p_anchored = 0;
+}
+#endif
+
+
+#ifdef ENABLE_MAILBOX
+/* MAILBOXES */
+
+/* A process may be given a mailbox of a fixed number of message slots
+   before the scheduler starts.  Other processes can then post()
+   messages to it without waiting for it to receive them: the message
+   is copied into the mailbox, and receive() takes messages from there
+   in FIFO order before looking at the queue of waiting senders.  If
+   the mailbox is full, the mailbox policy says whether post() should
+   wait as send() does, discard the oldest message, or return ERROR.
+   A poster that waits joins the ordinary queue of senders, so a later
+   post() may overtake it once space appears.  A mailbox belongs to
+   the slot in the process table rather than the process: when the
+   process exits, the mailbox is emptied, and a process later spawned
+   with the same pid receives in it, so its storage is never lost. */
+
+/* mailbox -- allocate a mailbox for process pid */
+void mailbox(int pid, int nslots, int policy) {
+    struct proc *p = &ptable[pid];
+
+    if (current != NULL)
+         panic("mailbox() called after scheduler startup");
+
+    if (pid <= IDLE || pid >= NPROCS || p->p_state == DEAD)
+         panic("mailbox() for non-existent process %d", pid);
+
+    if (nslots <= 0 || policy < MB_BLOCK || policy > MB_FAIL)
+         panic("Bad mailbox parameters");
+
+    struct mailbox *mb = sbrk(sizeof(struct mailbox));
+    mb->mb_buf = sbrk(nslots * sizeof(message));
+    mb->mb_size = nslots;
+    mb->mb_count = mb->mb_head = 0;
+    mb->mb_policy = policy;
+    mb->mb_hiwater = 0;
+    mb->mb_dropped = 0;
+    p->p_mbox = mb;
+}
+
+#define mb_slot(mb, i) (&(mb)->mb_buf[((mb)->mb_head + (i)) % (mb)->mb_size])
+
+/* mb_take -- remove the oldest message acceptable to the receiver */
+static int mb_take(struct mailbox *mb, int accept, message *msg) {
+    for (int i = 0; i < mb->mb_count; i++) {
+        message *m = mb_slot(mb, i);
+
+        if (accept == ANY || accept == m->m_sender) {
+            *msg = *m;
+
+            // Close the gap by moving older messages up one slot
+            for (int j = i; j > 0; j--)
+                *mb_slot(mb, j) = *mb_slot(mb, j-1);
+            mb->mb_head = (mb->mb_head + 1) % mb->mb_size;
+            mb->mb_count--;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* mini_post -- send a message without waiting for the receiver */
+static int mini_post(int dst, message *msg) {
+    int src = current->p_pid;
+    struct proc *pdst = &ptable[dst];
+    struct mailbox *mb;
+
+    if (dst < 0 || dst >= NPROCS || pdst->p_state == DEAD)
+        panic("Posting to a non-existent process %d", dst);
+
+    if ((mb = pdst->p_mbox) == NULL)
+        panic("Posting to process %d, which has no mailbox", dst);
+
+    trace(TR_SEND, src, dst, msg->m_type);
+
+    if (mb->mb_count == 0 && pdst->p_state == RECEIVING
+        && (pdst->p_accept == ANY || pdst->p_accept == src)) {
+        // Receiver is waiting: deliver the message directly
+        *(pdst->p_message) = *msg;
+        pdst->p_message->m_sender = src;
+        if (pdst->p_accept == src) replied(pdst);
+#ifdef ENABLE_TIMEOUTS
+        if (pdst->p_timeout != NO_TIME)
+             cancel_timeout(pdst);
+#endif
+        make_ready(pdst);
+
+        if (pdst->p_priority < current->p_priority) {
+            make_ready(current);
+            choose_proc();
+        }
+
+        return OK;
+    }
+
+    if (mb->mb_count == mb->mb_size) {
+        switch (mb->mb_policy) {
+        case MB_BLOCK:
+            // Wait in the queue of senders as if for send()
+            current->p_state = SENDING;
+            current->p_message = msg;
+            enqueue(pdst);
+            choose_proc();
+            return OK;
+
+        case MB_DROP:
+            mb->mb_head = (mb->mb_head + 1) % mb->mb_size;
+            mb->mb_count--;
+            mb->mb_dropped++;
+            break;
+
+        default:
+            mb->mb_dropped++;
+            return ERROR;
+        }
+    }
+
+    message *m = mb_slot(mb, mb->mb_count);
+    *m = *msg;
+    m->m_sender = src;
+    mb->mb_count++;
+    if (mb->mb_count > mb->mb_hiwater)
+        mb->mb_hiwater = mb->mb_count;
+
+    return OK;
 }
 #endif
 
@@ -273,6 +1341,8 @@ static void mini_send(int dst, message *msg) {
     if (dst < 0 || dst >= NPROCS || pdst->p_state == DEAD)
         panic("Sending to a non-existent process %d", dst);
 
+    trace(TR_SEND, src, dst, msg->m_type);
+
     if (pdst->p_state == RECEIVING
         && (pdst->p_accept == ANY || pdst->p_accept == src)) {
         // Receiver is waiting for us
@@ -282,38 +1352,53 @@ static void mini_send(int dst, message *msg) {
         if (pdst->p_timeout != NO_TIME)
              cancel_timeout(pdst);
 #endif
-        make_ready(pdst);
+        int reply = (pdst->p_accept == src);
+        if (reply) replied(pdst);
+        pdst->p_state = READY;  // Not waiting for us any more
+        int fell = disinherit();
+
+        if (reply && pdst->p_priority <= current->p_priority
+            && can_handoff(pdst)) {
+            // Pass control straight back to the client
+            make_ready(current);
+            handoff(pdst);
+        } else {
+            make_ready(pdst);
+
+            // If we were running on loan, pdst or another may go first
+            if (fell) give_way();
+        }
     } else {
         // Sender must wait by joining the receiver's queue
         current->p_state = SENDING;
         current->p_message = msg;
-        current->p_next = NULL;
-
-        if (pdst->p_waiting == NULL)
-            pdst->p_waiting = current;
-        else {
-            struct proc *r = pdst->p_waiting;
-            while (r->p_next != NULL)
-                r = r->p_next;
-            r->p_next = current;
-        }
-
+        enqueue(pdst);
         choose_proc();
     }
 }
 
-/* mini_receive -- receive a message */
-static void mini_receive(int accept, message *msg
-#ifdef ENABLE_TIMEOUTS
-                         , int timeout
-#endif
-     ) {
+/* take_message -- find a message for current without waiting */
+static int take_message(int accept, message *msg) {
     // First see if an interrupt is pending
     if (current->p_pending && (accept == ANY || accept == HARDWARE)) {
-        current->p_pending = 0;
+        intr_message(current, msg);
+        return 1;
+    }
+
+#ifdef ENABLE_MAILBOX
+    // Posted messages come before those from waiting senders
+    if (accept != HARDWARE && current->p_mbox != NULL
+        && mb_take(current->p_mbox, accept, msg))
+        return 1;
+#endif
+
+    // Then see if any notifications have arrived
+    if (current->p_notify != 0 && accept == ANY) {
         msg->m_sender = HARDWARE;
-        msg->m_type = INTERRUPT;
-        return;
+        msg->m_type = NOTIFY;
+        msg->m_i1 = current->p_notify;
+        current->p_notify = 0;
+        return 1;
     }
 
     if (accept != HARDWARE) {
@@ -332,18 +1417,35 @@ static void mini_receive(int accept, message *msg
                 msg->m_sender = psrc->p_pid;
 
                 if (psrc->p_state == BOTH)
-                    psrc->p_state = RECEIVING;
+                    await_reply(psrc, current);
                 else {
-                    /* Non-preemptive: the receiver continues to run
-                       even if the sender has lower priority */
+                    /* The receiver has inherited the sender's
+                       priority, so it may continue to run */
                     make_ready(psrc);
                 }
                 
-                return;
+                return 1;
             }
             prev = psrc;
         }
     }
+
+    return 0;
+}
+
+/* mini_receive -- receive a message */
+static void mini_receive(int accept, message *msg
+#ifdef ENABLE_TIMEOUTS
+                         , int timeout
+#endif
+     ) {
+    trace(TR_RECEIVE, current->p_pid, accept, 0);
+    int fell = disinherit();
+
+    if (take_message(accept, msg)) {
+        if (fell) give_way();
+        return;
+    }
      
     if (accept != ANY && accept != HARDWARE &&
         (accept < 0 || accept >= NPROCS || ptable[accept].p_state == DEAD))
@@ -354,6 +1456,7 @@ static void mini_receive(int accept, message *msg
          // No message, and we are not prepared to wait
          msg->m_type = TIMEOUT;
          msg->m_sender = HARDWARE;
+         if (fell) give_way();
          return;
     }
 #endif
@@ -375,6 +1478,7 @@ static void mini_sendrec(int dst, message *msg) {
     if (dst < 0 || dst >= NPROCS || pdst->p_state == DEAD)
         panic("Sending to a non-existent process %d", dst);
 
+    trace(TR_SENDREC, src, dst, msg->m_type);
     msg->m_sender = src;
     current->p_accept = dst;
     current->p_message = msg;
@@ -384,25 +1488,77 @@ static void mini_sendrec(int dst, message *msg) {
         // Receiver is waiting for us
         *(pdst->p_message) = *msg;
         pdst->p_message->m_sender = src;
-        current->p_state = RECEIVING;
+        if (pdst->p_accept == src) replied(pdst);
+        await_reply(current, pdst);
+        inherit(pdst);
+#ifdef ENABLE_TIMEOUTS
+        if (pdst->p_timeout != NO_TIME)
+             cancel_timeout(pdst);
+#endif
+
+        if (can_handoff(pdst)) {
+            // Switch straight to the server
+            handoff(pdst);
+            return;
+        }
+
         make_ready(pdst);
     } else {
         // Sender must wait by joining the receiver's queue
         current->p_state = BOTH;
-        current->p_next = NULL;
-        if (pdst->p_waiting == NULL)
-            pdst->p_waiting = current;
-        else {
-            struct proc *r = pdst->p_waiting;
-            while (r->p_next != NULL)
-                r = r->p_next;
-            r->p_next = current;
-        }
+        enqueue(pdst);
     }
 
     choose_proc();
 }    
 
+/* Notifications let one process signal another without blocking.
+   Each call ORs some event bits into the pending mask of the
+   destination, and the bits are delivered as a single NOTIFY message
+   (from HARDWARE, with the bits in m_i1) when the destination next
+   receives from ANY.  They are not delivered to receive(HARDWARE), so
+   a driver that waits there for its interrupt never sees a NOTIFY.
+   Several notifications sent before the destination runs are merged
+   into one message. */
+
+/* deliver_bits -- add notification bits; true if pdst is now ready */
+static int deliver_bits(struct proc *pdst, unsigned bits) {
+    if (pdst->p_state == RECEIVING && pdst->p_accept == ANY) {
+        // Receiver is waiting: deliver the bits now
+        pdst->p_message->m_sender = HARDWARE;
+        pdst->p_message->m_type = NOTIFY;
+        pdst->p_message->m_i1 = pdst->p_notify | bits;
+        pdst->p_notify = 0;
+#ifdef ENABLE_TIMEOUTS
+        if (pdst->p_timeout != NO_TIME)
+             cancel_timeout(pdst);
+#endif
+        make_ready(pdst);
+        return 1;
+    }
+
+    pdst->p_notify |= bits;
+    return 0;
+}
+
+/* mini_notify -- post notification bits without blocking */
+static void mini_notify(int dst, unsigned bits) {
+    struct proc *pdst = &ptable[dst];
+
+    if (dst < 0 || dst >= NPROCS || pdst->p_state == DEAD)
+        panic("Notifying a non-existent process %d", dst);
+
+    if (bits == 0) return;
+    trace(TR_NOTIFY, current->p_pid, dst, bits);
+
+    if (deliver_bits(pdst, bits)
+        && pdst->p_priority < current->p_priority) {
+        // Let the more urgent receiver run first
+        make_ready(current);
+        choose_proc();
+    }
+}
+
 
 /* INTERRUPT HANDLING */
 
@@ -412,15 +1568,84 @@ static void mini_sendrec(int dst, message *msg) {
    re-enabled in the handler once it has reacted to the interrupt.
 
    We only deal with the 32 interrupts >= 0, not the 16 exceptions
-   that are < 0 this way. */
+   that are < 0 this way.
+
+   Each process has a bitmap p_irqs of the IRQs that have fired since
+   it last received an INTERRUPT message, and for each IRQ we count
+   the times it has fired.  The next INTERRUPT message carries the
+   bitmap in m_i1, and the counts packed into the eight bytes of m_x2
+   and m_x3, one for each IRQ in the bitmap in ascending order.  So a
+   process that handles several IRQs can tell which of them need
+   attention.  While the IRQ stays disabled, the count can only reach
+   1, but a process that re-enables it before it has finished work
+   will see any further interrupts counted, not lost.
+
+   A driver may instead register a top half with connect_top().  This
+   is a short function that runs in handler mode as soon as the
+   interrupt arrives: it must clear the device event, and may move
+   data between the device and a buffer shared with the task.  The
+   IRQ is then left enabled, and the task is sent an INTERRUPT message
+   only if the top half returns non-zero, so that (for example) a
+   serial driver need only be woken at the end of a line, not for
+   each character.  Every interrupt is still counted, so the count in
+   the next message says how many events the top half has absorbed. */
 
 static int handler[32];
+static byte irq_count[32];      // Times each IRQ has fired, up to 255
+static int (*top_half[32])(void); // Optional top half for each IRQ
+
+/* intr_message -- fill in INTERRUPT message, clearing pending IRQs */
+static void intr_message(struct proc *p, message *m) {
+    unsigned mask = p->p_irqs;
+    byte *count = &m->m_x2.m_b.m_bw;
+    int k = 0;
+
+    m->m_sender = HARDWARE;
+    m->m_type = INTERRUPT;
+    m->m_i1 = mask;
+    m->m_i2 = m->m_i3 = 0;
+
+    for (int irq = 0; mask != 0; irq++, mask >>= 1) {
+        if (mask & 1) {
+            if (k < 8) count[k++] = irq_count[irq];
+            irq_count[irq] = 0;
+        }
+    }
+
+    p->p_irqs = 0;
+    p->p_pending = 0;
+}
+
+/* intr_count -- find count for an IRQ in an INTERRUPT message */
+int intr_count(message *m, int irq) {
+    unsigned mask = m->m_i1;
+    int k = 0;
+
+    if (m->m_type != INTERRUPT || ! (mask & BIT(irq)))
+        return 0;
+
+    // Count the IRQs below this one
+    for (mask &= BIT(irq)-1; mask != 0; mask &= mask-1) k++;
+
+    if (k >= 8) return 1;       // Not recorded: at least one
+    return (&m->m_x2.m_b.m_bw)[k];
+}
 
 /* connect -- connect the current process to an IRQ */
 void connect(int irq) {
     if (irq < 0) panic("Can't connect to CPU exceptions");
-    current->p_priority = 0;
+    current->p_priority = current->p_basepri = P_HANDLER;
+    handler[irq] = current->p_pid;
+    top_half[irq] = NULL;
+    enable_irq(irq);
+}
+
+/* connect_top -- connect the current process to an IRQ with a top half */
+void connect_top(int irq, int (*top)(void)) {
+    if (irq < 0) panic("Can't connect to CPU exceptions");
+    current->p_priority = current->p_basepri = P_HANDLER;
     handler[irq] = current->p_pid;
+    top_half[irq] = top;
     enable_irq(irq);
 }
 
@@ -429,15 +1654,21 @@ void reconnect(int irq) {
         to enable it again.  But the device has probably set the
         pending bit of the interrupt a second time after the interrupt
         handler returned.  So we must clear it here.  Any extra
-        interrupts that arrive before the task runs are lost. */
+        interrupts that arrive before the task runs are lost.  There
+        is no need to call this for an IRQ that has a top half. */
      clear_pending(irq);
      enable_irq(irq);
 }
 
+/* getpid -- find process ID of the current process */
+int getpid(void) {
+    return current->p_pid;
+}
+
 /* priority -- set process priority */
 void priority(int p) {
-    if (p > 2) panic("Bad priority %u\n", p);
-    current->p_priority = p;
+    if (p < P_HANDLER || p >= P_IDLE) panic("Bad priority %d", p);
+    current->p_priority = current->p_basepri = p;
 }
 
 /* interrupt -- send interrupt message */
@@ -447,10 +1678,13 @@ void interrupt(int dst) {
     if (pdst->p_state == RECEIVING
         && (pdst->p_accept == ANY || pdst->p_accept == HARDWARE)) {
         // Receiver is waiting for an interrupt
-        pdst->p_message->m_sender = HARDWARE;
-        pdst->p_message->m_type = INTERRUPT;
+        intr_message(pdst, pdst->p_message);
+#ifdef ENABLE_TIMEOUTS
+        if (pdst->p_timeout != NO_TIME)
+             cancel_timeout(pdst);
+#endif
         make_ready(pdst);
-        if (current->p_priority > 0)
+        if (pdst->p_priority < current->p_priority)
              // Preempt lower-priority process
              reschedule();
     } else {
@@ -462,16 +1696,32 @@ void interrupt(int dst) {
 /* All interrupts are handled by this common handler, which disables the
    interrupt temporarily, then sends or queues a message to the registered
    handler task.  Normally the handler task will deal with the cause of the
-   interrupt, then re-enable it using reconnect(). */
+   interrupt, then re-enable it using reconnect().  If the IRQ has a top
+   half, we call it instead of disabling the interrupt, and wake the task
+   only if the top half asks for it. */
 
 /* phos_interrupt -- handle an interrupt */
 void phos_interrupt(int irq) {
     int task;
+#ifdef ENABLE_ACCOUNTING
+    unsigned start = usec_clock(2);
+#endif
 
     if (irq < 0 || (task = handler[irq]) == 0)
         panic("Unexpected interrupt %d", irq);
-    disable_irq(irq);
-    interrupt(task);
+    if (irq_count[irq] < 255) irq_count[irq]++;
+
+    if (top_half[irq] == NULL)
+        disable_irq(irq);
+
+    if (top_half[irq] == NULL || (*top_half[irq])()) {
+        trace(TR_INTR, task, irq, 0);
+        ptable[task].p_irqs |= BIT(irq);
+        interrupt(task);
+    }
+#ifdef ENABLE_ACCOUNTING
+    charge_irq(start);
+#endif
 }
 
 /* hardfault_handler -- substitutes for the definition in startup.c */
@@ -484,8 +1734,8 @@ void hardfault_handler(void) {
 
 #define IDLE_STACK 128
 
-static void init_ptable(struct proc *p, int pid, char *name, unsigned stksize) {
-    unsigned char *stack = sbrk(stksize);
+static void init_ptable(struct proc *p, int pid, char *name,
+                        unsigned char *stack, unsigned stksize) {
     unsigned *sp = (unsigned *) &stack[stksize];
 
     /* Blank out the stack space to help detect overflow */
@@ -496,14 +1746,30 @@ static void init_ptable(struct proc *p, int pid, char *name, unsigned stksize) {
     p->p_name[15] = '\0';
     p->p_sp = sp;
     p->p_stack = stack;
+    p->p_scan = (unsigned *) stack;
+    p->p_mark = sp;
     p->p_stksize = stksize;
+    p->p_sclass = -1;
     p->p_state = READY;
-    p->p_priority = P_LOW;
+    p->p_priority = p->p_basepri = P_LOW;
+#ifdef ENABLE_TIMESLICE
+    p->p_quantum = 0;
+#endif
+    p->p_preempts = 0;
+#ifdef ENABLE_ACCOUNTING
+    p->p_time = p->p_window = 0;
+    p->p_load = 0;
+#endif
     p->p_waiting = 0;
+    p->p_clients = NULL;
     p->p_pending = 0;
+    p->p_irqs = 0;
+    p->p_notify = 0;
     p->p_accept = ANY;
 #ifdef ENABLE_TIMEOUTS
     p->p_timeout = NO_TIME;
+    p->p_period = p->p_anchored = 0;
+    p->p_release = p->p_missed = 0;
 #endif
     p->p_message = NULL;
     p->p_next = NULL;
@@ -511,11 +1777,20 @@ static void init_ptable(struct proc *p, int pid, char *name, unsigned stksize) {
 
 /* phos_init -- set up initial values */
 void phos_init(void) {
+    kstk_init();
+
     // Create idle task as process 0
     idle_proc = &ptable[IDLE];
-    init_ptable(idle_proc, IDLE, "IDLE", IDLE_STACK);
+    init_ptable(idle_proc, IDLE, "IDLE", sbrk(IDLE_STACK), IDLE_STACK);
     idle_proc->p_state = IDLING;
-    idle_proc->p_priority = 3;
+    idle_proc->p_priority = idle_proc->p_basepri = P_IDLE;
+
+#ifdef ENABLE_TIMESLICE
+    slice_init();
+#endif
+#if defined(ENABLE_ACCOUNTING) || defined(ENABLE_TRACE)
+    usec_init();
+#endif
 }
 
 #define INIT_PSR 0x01000000     /* Thumb bit is set */
@@ -524,15 +1799,34 @@ void phos_init(void) {
 #define R0_SAVE 8
 #define R1_SAVE 9
 #define R2_SAVE 10
+#define R3_SAVE 11
+#define R12_SAVE 12
 #define LR_SAVE 13
 #define PC_SAVE 14
 #define PSR_SAVE 15
 
 #define roundup(x, n) (((x) + ((n)-1)) & ~((n)-1))
 
+/* make_proc -- set up a process with a fake exception frame */
+static void make_proc(struct proc *p, int pid, char *name,
+                      void (*body)(int), int arg,
+                      unsigned char *stack, unsigned stksize) {
+    init_ptable(p, pid, name, stack, stksize);
+
+    /* Fake an exception frame */
+    unsigned *sp = p->p_sp - 16;
+    memset(sp, 0, 64);
+    sp[PSR_SAVE] = INIT_PSR;
+    sp[PC_SAVE] = (unsigned) body & ~0x1; // Activate the process body
+    sp[LR_SAVE] = (unsigned) exit; // Make it return to exit()
+    sp[R0_SAVE] = (unsigned) arg;  // Pass the supplied argument in R0
+    p->p_sp = sp;
+}
+
 /* start -- initialise process to run later */
 void start(int pid, char *name, void (*body)(int), int arg, int stksize) {
     struct proc *p = &ptable[pid];
+    int c = sclass(stksize);
 
     if (current != NULL)
          panic("start() called after scheduler startup");
@@ -540,18 +1834,140 @@ void start(int pid, char *name, void (*body)(int), int arg, int stksize) {
     if (p->p_state != DEAD)
          panic("pid for process %s is already taken", name);
 
-    init_ptable(p, pid, name, roundup(stksize, 4));
+    if (c >= 0 && stksize == sclass_size(c)) {
+        // Use the stack pool, so the stack can be recycled after exit;
+        // other sizes are not rounded up, so as not to waste RAM
+        unsigned char *stack = stk_alloc(c);
+        if (stack == NULL) panic("Phos is out of memory");
+        make_proc(p, pid, name, body, arg, stack, sclass_size(c));
+        p->p_sclass = c;
+    } else {
+        stksize = roundup(stksize, 4);
+        make_proc(p, pid, name, body, arg, sbrk(stksize), stksize);
+    }
 
-    /* Fake an exception frame */
-    unsigned *sp = p->p_sp - 16;
-    memset(sp, 0, 64);
-    sp[PSR_SAVE] = INIT_PSR;
-    sp[PC_SAVE] = (unsigned) body & ~0x1; // Activate the process body
-    sp[LR_SAVE] = (unsigned) exit; // Make it return to exit()
-    sp[R0_SAVE] = (unsigned) arg;  // Pass the supplied argument in R0
-    p->p_sp = sp;
+    make_ready(p);
+}
+
+
+/* DYNAMIC PROCESSES */
+
+/* Once the scheduler is running, new processes can be created with
+   spawn(), which takes the highest-numbered free slot in the process
+   table and a stack from the pool.  A process that exits, either by
+   calling exit() or by returning from its body, gives back its slot
+   and, if it came from the pool, its stack.  Any process that is
+   waiting to send to it or for a reply from it is released with an
+   ERROR message or an ERROR result from send() or post(), and any
+   interrupt it was connected to is disabled. */
+
+/* mini_spawn -- create a new process, returning its pid or -1 */
+static int mini_spawn(char *name, void (*body)(int), int arg, int stksize) {
+    int pid, c = sclass(stksize);
+    unsigned char *stack;
 
+    if (c < 0) return -1;
+
+    for (pid = NPROCS-1; pid > IDLE; pid--) {
+        if (ptable[pid].p_state == DEAD) break;
+    }
+
+    if (pid == IDLE || (stack = stk_alloc(c)) == NULL)
+        return -1;
+
+    struct proc *p = &ptable[pid];
+    make_proc(p, pid, name, body, arg, stack, sclass_size(c));
+    p->p_sclass = c;
     make_ready(p);
+
+    if (p->p_priority < current->p_priority) {
+        make_ready(current);
+        choose_proc();
+    }
+
+    return pid;
+}
+
+/* A driver that keeps resources on behalf of its clients may register
+   an exit hook with connect_exit().  Like a top half, the hook runs in
+   handler mode, and must be short and make no system calls: it is
+   called as each other process exits, with the pid of that process,
+   before the pid can be given to a new process.  The hook returns
+   notification bits for the driver, or 0 if it need not be woken. */
+
+static unsigned (*exit_hook[NPROCS])(int pid); // Exit hook for each process
+
+/* connect_exit -- register an exit hook for the current process */
+void connect_exit(unsigned (*hook)(int pid)) {
+    exit_hook[current->p_pid] = hook;
+}
+
+/* abort_wait -- release a process blocked on one that has exited */
+static void abort_wait(struct proc *r, int pid) {
+    if (r->p_state == BOTH || r->p_state == RECEIVING) {
+        r->p_message->m_sender = pid;
+        r->p_message->m_type = ERROR;
+    } else if (r->p_state == SENDING) {
+        // send() or post() returns ERROR
+        r->p_sp[R0_SAVE] = ERROR;
+    }
+#ifdef ENABLE_TIMEOUTS
+    if (r->p_timeout != NO_TIME)
+        cancel_timeout(r);
+#endif
+    make_ready(r);
+}
+
+/* mini_exit -- terminate the current process */
+static void mini_exit(void) {
+    struct proc *p = current, *r, *next;
+    int pid = p->p_pid;
+
+    p->p_state = DEAD;
+
+    for (r = p->p_waiting; r != NULL; r = next) {
+        next = r->p_next;
+        abort_wait(r, pid);
+    }
+    p->p_waiting = NULL;
+    p->p_clients = NULL;
+
+#ifdef ENABLE_MAILBOX
+    // Empty the mailbox, ready for the next process with our pid
+    if (p->p_mbox != NULL)
+        p->p_mbox->mb_count = p->p_mbox->mb_head = 0;
+#endif
+
+    for (int i = 0; i < NPROCS; i++) {
+        r = &ptable[i];
+        if (r->p_state == RECEIVING && r->p_accept == pid)
+            abort_wait(r, pid);
+    }
+
+    for (int irq = 0; irq < 32; irq++) {
+        if (handler[irq] == pid) {
+            disable_irq(irq);
+            handler[irq] = 0;
+            top_half[irq] = NULL;
+        }
+    }
+
+    // Let drivers forget about us before the pid can be reused
+    exit_hook[pid] = NULL;
+    for (int i = 0; i < NPROCS; i++) {
+        if (exit_hook[i] != NULL && ptable[i].p_state != DEAD) {
+            unsigned bits = (*exit_hook[i])(pid);
+            if (bits != 0) deliver_bits(&ptable[i], bits);
+        }
+    }
+
+    /* The stack is released while we are still using it, but only
+       its base is overwritten, and no more is allocated before we
+       leave it for good. */
+    if (p->p_sclass >= 0)
+        stk_release(p->p_stack, p->p_sclass);
+
+    choose_proc();
 }
 
 /* setstack -- enter thread mode with specified stack */
@@ -570,6 +1986,8 @@ void phos_start(void) {
     // Idle only runs again when there's nothing to do.
     while (1) {
         pause();                // Wait for an interrupt
+        idle_wakeups++;
+        sample_stacks();
     }
 }
 
@@ -584,17 +2002,27 @@ void phos_start(void) {
 #define SYS_EXIT 4
 #define SYS_DUMP 5
 #define SYS_TICK 6
+#define SYS_NOTIFY 7
+#define SYS_POST 8
+#define SYS_SPAWN 9
+#define SYS_CPULOAD 10
+#define SYS_SLEEP 11
+#define SYS_WAITPERIOD 12
 
 /* system_call -- entry from system call traps */
 unsigned *system_call(unsigned *psp) {
-    short *pc = (short *) psp[PC_SAVE]; // Program counter
-    int op = pc[-1] & 0xff;      // Syscall number from svc instruction
+    int op = psp[R3_SAVE] & 0xff; // Syscall number from r3
     int x = psp[R0_SAVE];        // PID or IRQ or prio from r0
     message *m = (message *) psp[R1_SAVE];  // Message pointer from r1
 #ifdef ENABLE_TIMEOUTS
     int t = psp[R2_SAVE];        // Timeout from r2
 #endif
 
+    check_stack(psp);
+#ifdef ENABLE_ACCOUNTING
+    charge();
+#endif
+
     // Save sp of the current process
     current->p_sp = psp;
 
@@ -605,6 +2033,7 @@ unsigned *system_call(unsigned *psp) {
          break;
 
     case SYS_SEND:
+         psp[R0_SAVE] = OK;     // Before we switch away
          mini_send(x, m);
          break;
 
@@ -620,15 +2049,47 @@ unsigned *system_call(unsigned *psp) {
          mini_sendrec(x, m);
          break;
 
-#ifdef ENABLE_TIMEOUTS
     case SYS_TICK:
-         mini_tick(x);
+#ifdef ENABLE_TIMEOUTS
+         psp[R0_SAVE] = mini_tick(x);
+#else
+         psp[R0_SAVE] = -1;
+#endif
+         break;
+
+#ifdef ENABLE_TIMEOUTS
+    case SYS_SLEEP:
+         mini_sleep(x);
+         break;
+
+    case SYS_WAITPERIOD:
+         psp[R0_SAVE] = mini_wait_period();
+         break;
+#endif
+
+    case SYS_NOTIFY:
+         mini_notify(x, (unsigned) m);
+         break;
+
+#ifdef ENABLE_MAILBOX
+    case SYS_POST:
+         psp[R0_SAVE] = mini_post(x, m);
          break;
 #endif
 
+    case SYS_SPAWN:
+        psp[R0_SAVE] = mini_spawn((char *) x, (void (*)(int)) m,
+                                  psp[R2_SAVE], psp[R12_SAVE]);
+        break;
+
+#ifdef ENABLE_ACCOUNTING
+    case SYS_CPULOAD:
+        psp[R0_SAVE] = mini_cpuload(x, (unsigned *) m);
+        break;
+#endif
+
     case SYS_EXIT:
-        current->p_state = DEAD;
-        choose_proc();
+        mini_exit();
         break;
 
     case SYS_DUMP:
@@ -648,9 +2109,17 @@ unsigned *system_call(unsigned *psp) {
 
 /* cxtswitch -- handler for PendSV trap */
 unsigned *cxtswitch(unsigned *psp) {
+     struct proc *prev = current;
+
+     check_stack(psp);
+#ifdef ENABLE_ACCOUNTING
+     charge();
+#endif
      current->p_sp = psp;
      make_ready(current);
      choose_proc();
+     if (current != prev)
+          prev->p_preempts++;
      return current->p_sp;
 }
 
@@ -659,7 +2128,7 @@ unsigned *cxtswitch(unsigned *psp) {
 
 /* Each function defined here leaves its arguments in r0 and r1 and
    executes an svc instruction with operand equal to the system call
-   number.  After state has been saved, system_call() is invoked and
+   number, which is also put in r3.  system_call() is invoked and
    retrieves the call number and arguments from the exception frame.
    Calls to these functions must not be inlined, or the arguments will
    not be found in the right places. */
@@ -670,8 +2139,10 @@ void NOINLINE yield(void) {
      syscall(SYS_YIELD);
 }
 
-void NOINLINE send(int dst, message *msg) {
-     syscall(SYS_SEND);
+int NOINLINE send(int dst, message *msg) {
+     register int r0 asm("r0") = dst;
+     syscall_r0(SYS_SEND, r0);
+     return r0;
 }
 
 #ifdef ENABLE_TIMEOUTS
@@ -687,6 +2158,39 @@ void NOINLINE sendrec(int dst, message *msg) {
      syscall(SYS_SENDREC);
 }
 
+void NOINLINE notify(int dst, unsigned bits) {
+     syscall(SYS_NOTIFY);
+}
+
+#ifdef ENABLE_MAILBOX
+int NOINLINE post(int dst, message *msg) {
+     register int r0 asm("r0") = dst;
+     syscall_r0(SYS_POST, r0);
+     return r0;
+}
+#endif
+
+int NOINLINE spawn(char *name, void (*body)(int), int arg, int stksize) {
+     // r3 carries the call number, so stksize goes in r12; the
+     // arguments are bound explicitly, since the asm must not depend
+     // on what the compiler has left in r1-r3
+     register int r0 asm("r0") = (int) name;
+     register void (*r1)(int) asm("r1") = body;
+     register int r2 asm("r2") = arg;
+     asm volatile ("mov ip, %3\n\tmovs r3, %4\n\tsvc %4"
+                   : "+r"(r0) : "r"(r1), "r"(r2), "r"(stksize),
+                     "i"(SYS_SPAWN) : "r3", "ip");
+     return r0;
+}
+
+#ifdef ENABLE_ACCOUNTING
+int NOINLINE cpuload(int pid, unsigned *usec) {
+     register int r0 asm("r0") = pid;
+     syscall_r0(SYS_CPULOAD, r0);
+     return r0;
+}
+#endif
+
 void NOINLINE exit(void) {
      syscall(SYS_EXIT);
 }
@@ -695,10 +2199,24 @@ void NOINLINE dump(void) {
      syscall(SYS_DUMP);
 }
 
-void NOINLINE tick(int ms) {
-     syscall(SYS_TICK);
+int NOINLINE tick(int ms) {
+     register int r0 asm("r0") = ms;
+     syscall_r0(SYS_TICK, r0);
+     return r0;
+}
+
+#ifdef ENABLE_TIMEOUTS
+void NOINLINE sleep(int ms) {
+     syscall(SYS_SLEEP);
 }
 
+int NOINLINE wait_next_period(void) {
+     register int r0 asm("r0") = 0;
+     syscall_r0(SYS_WAITPERIOD, r0);
+     return r0;
+}
+#endif
+
 
 /* DEBUG PRINTING */
 
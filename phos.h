@@ -56,12 +56,22 @@ typedef unsigned char byte;
 #define SEND 11
 #define RECEIVE 12
 #define PACKET 13
+#define NOTIFY 14
+
+/* Possible priorities: 0 is the highest.  Applications may use any
+   level from P_HANDLER to P_IDLE-1, not just the named ones. */
+#ifndef NPRIO
+#define NPRIO 16                // Number of levels (at most 32)
+#endif
 
-/* Possible priorities */
 #define P_HANDLER 0             // Interrupt handler
-#define P_HIGH 1                // Responsive
-#define P_LOW 2                 // Normal
-#define P_IDLE 3                // The idle process
+#define P_HIGH 4                // Responsive
+#define P_LOW 8                 // Normal
+#define P_IDLE (NPRIO-1)        // The idle process
+
+#if NPRIO <= P_LOW+1
+#error "NPRIO is too small: P_LOW must be above P_IDLE"
+#endif
 
 typedef struct {                // 16 bytes
     unsigned short m_type;      // Type of message
@@ -93,10 +103,58 @@ typedef struct {                // 16 bytes
 void start(int pid, char *name, void (*body)(int), int arg, int stksize);
 
 #define STACK 1024              // Default stack size
+#define MAX_STACK 2048          // Largest stack for spawn()
+
+/* spawn -- create a process while the scheduler is running: returns
+   the new pid, or -1 if there is no free slot or no memory */
+int spawn(char *name, void (*body)(int), int arg, int stksize);
+
+#ifdef ENABLE_ACCOUNTING
+/* cpuload -- CPU load of a process (or HARDWARE for interrupts) over
+   the last second in tenths of a percent; also total run time in usec */
+int cpuload(int pid, unsigned *usec);
+#endif
+
+#ifdef ENABLE_TRACE
+/* trace_get -- fetch the oldest 8-byte trace record; false if none */
+int trace_get(unsigned rec[2]);
+
+/* trace_freeze -- stop (if freeze is true) or restart tracing */
+void trace_freeze(int freeze);
+#endif
+
+/* stack_used -- bytes of stack used so far by a process, or by the
+   kernel if pid is HARDWARE */
+int stack_used(int pid);
+
+/* Pools of fixed-size blocks, created by init() */
+typedef struct pool pool;
+
+/* pool_create -- make a pool of n blocks of the given size */
+pool *pool_create(char *name, int size, int n);
+
+/* pool_alloc -- take a block from a pool, or NULL if it is empty */
+void *pool_alloc(pool *pl);
+
+/* pool_free -- return a block to its pool */
+void pool_free(pool *pl, void *blk);
+
+/* pool_stats -- blocks in use, most ever in use, failed allocations */
+void pool_stats(pool *pl, int *inuse, int *hiwater, int *failed);
+
+#ifdef ENABLE_MAILBOX
+/* mailbox -- give a started process a buffer for posted messages */
+void mailbox(int pid, int nslots, int policy);
+
+/* What post() does when the mailbox is full */
+#define MB_BLOCK 0              // Wait like send()
+#define MB_DROP 1               // Discard the oldest message
+#define MB_FAIL 2               // Return ERROR
+#endif
 
 /* System calls */
 void yield(void);
-void send(int dst, message *msg);
+int send(int dst, message *msg);
 #ifdef ENABLE_TIMEOUTS
 void receive_t(int src, message *msg, int timeout);
 #define receive(dst, msg) receive_t(dst, msg, -1)
@@ -104,16 +162,36 @@ void receive_t(int src, message *msg, int timeout);
 void receive(int src, message *msg);
 #endif
 void sendrec(int dst, message *msg);
-void tick(int ms);
+void notify(int dst, unsigned bits);
+#ifdef ENABLE_MAILBOX
+int post(int dst, message *msg);
+#endif
+int tick(int ms);
 void connect(int irq);
+void connect_top(int irq, int (*top)(void));
+void connect_exit(unsigned (*hook)(int pid));
 void reconnect(int irq);
 void priority(int p);
+int getpid(void);
+#ifdef ENABLE_TIMESLICE
+void quantum(int ms);
+#endif
+#ifdef ENABLE_TIMEOUTS
+void sleep(int ms);
+void period(int ms);
+int wait_next_period(void);
+#endif
 void exit(void);
 void dump(void);
 
 /* interrupt -- send INTERRUPT message from handler */
 void interrupt(int pid);
 
+/* An INTERRUPT message has in m_i1 a bitmap of the IRQs that have
+   fired since the last one, and intr_count() tells how many times
+   each of them fired (saturating at 255). */
+int intr_count(message *m, int irq);
+
 /* lock -- disable all interrupts */
 void lock(void);
 
@@ -146,13 +224,22 @@ void spin(void);
 
 /* serial.c */
 void serial_putc(char ch);
+void serial_write(const char *buf, int n);
 char serial_getc(void);
 void serial_printf(char *fmt, ...);
 void serial_init(void);
 
-/* timer.c */
+/* timer.c -- a PING from a timer has its handle in m_i2 */
 void timer_delay(int msec);
-void timer_pulse(int msec);
+void timer_delay_slack(int msec, int slack);
+int timer_pulse(int msec);
+int timer_pulse_slack(int msec, int slack);
+int timer_once(int msec);
+int timer_usec(int usec);
+void timer_cancel(int h);
+void timer_reset(int h, int delay);
+unsigned long long timer_millis(void);
+void timer_stats(int *wakeups, int *passes);
 void timer_init(void);
 
 /* i2c.c */
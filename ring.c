@@ -0,0 +1,135 @@
+/*
+ * ring.c
+ *
+ * This file is part of the Phos operating system for microcontrollers
+ * Copyright (c) 2018 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "phos.h"
+#include "ring.h"
+#include <string.h>
+
+/* ring_init -- set up a ring with given storage */
+void ring_init(ring *r, void *buf, unsigned size) {
+    if (size == 0 || (size & (size-1)) != 0)
+        panic("Ring size %d is not a power of 2", size);
+
+    r->r_buf = buf;
+    r->r_mask = size-1;
+    r->r_inp = r->r_outp = 0;
+}
+
+/* ring_put -- add a byte, returning 0 if the ring is full */
+int ring_put(ring *r, unsigned char ch) {
+    unsigned inp = r->r_inp;
+
+    if (inp - r->r_outp > r->r_mask) return 0;
+    r->r_buf[inp & r->r_mask] = ch;
+    ring_barrier();
+    r->r_inp = inp+1;
+    return 1;
+}
+
+/* ring_get -- remove a byte, returning -1 if the ring is empty */
+int ring_get(ring *r) {
+    unsigned outp = r->r_outp;
+    int ch;
+
+    if (r->r_inp == outp) return -1;
+    ring_barrier();
+    ch = r->r_buf[outp & r->r_mask];
+    ring_barrier();
+    r->r_outp = outp+1;
+    return ch;
+}
+
+/* ring_peek -- find contiguous waiting bytes, returning the count */
+unsigned ring_peek(ring *r, unsigned char **p) {
+    unsigned outp = r->r_outp;
+    unsigned n = r->r_inp - outp;
+    unsigned k = outp & r->r_mask;
+
+    // Stop at the end of the buffer
+    if (n > r->r_mask + 1 - k) n = r->r_mask + 1 - k;
+    ring_barrier();
+    *p = &r->r_buf[k];
+    return n;
+}
+
+/* ring_consume -- remove n bytes found by ring_peek */
+void ring_consume(ring *r, unsigned n) {
+    ring_barrier();
+    r->r_outp += n;
+}
+
+/* ring_reserve -- find contiguous free space, returning the count */
+unsigned ring_reserve(ring *r, unsigned char **p) {
+    unsigned inp = r->r_inp;
+    unsigned n = r->r_mask + 1 - (inp - r->r_outp);
+    unsigned k = inp & r->r_mask;
+
+    if (n > r->r_mask + 1 - k) n = r->r_mask + 1 - k;
+    *p = &r->r_buf[k];
+    return n;
+}
+
+/* ring_commit -- add n bytes stored in space from ring_reserve */
+void ring_commit(ring *r, unsigned n) {
+    ring_barrier();
+    r->r_inp += n;
+}
+
+/* ring_write -- add up to n bytes, returning the number added */
+unsigned ring_write(ring *r, const void *src, unsigned n) {
+    const unsigned char *s = src;
+    unsigned char *p;
+    unsigned done = 0, k;
+
+    // At most two spans, before and after the wrap
+    while (done < n && (k = ring_reserve(r, &p)) > 0) {
+        if (k > n - done) k = n - done;
+        memcpy(p, s + done, k);
+        ring_commit(r, k);
+        done += k;
+    }
+
+    return done;
+}
+
+/* ring_read -- remove up to n bytes, returning the number removed */
+unsigned ring_read(ring *r, void *dst, unsigned n) {
+    unsigned char *d = dst, *p;
+    unsigned done = 0, k;
+
+    while (done < n && (k = ring_peek(r, &p)) > 0) {
+        if (k > n - done) k = n - done;
+        memcpy(d + done, p, k);
+        ring_consume(r, k);
+        done += k;
+    }
+
+    return done;
+}
@@ -0,0 +1,97 @@
+/*
+ * ring.h
+ *
+ * This file is part of the Phos operating system for microcontrollers
+ * Copyright (c) 2018 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* A ring is a circular buffer of bytes shared between one producer
+   and one consumer, for example an interrupt top half and a driver
+   task.  The producer updates only r_inp and the consumer only
+   r_outp; both count bytes from the start and wrap round only when
+   used to index the buffer, so the number of bytes present is always
+   r_inp - r_outp, and no locking is needed.  The size must be a power
+   of 2.
+
+   Data is stored before the index that publishes it is advanced, and
+   read before the index that releases its space is advanced.  On the
+   Cortex-M0 with its single in-order core, it is enough to stop the
+   compiler from reordering these steps, and ring_barrier() does
+   that. */
+
+typedef struct {
+    unsigned char *r_buf;       /* Storage */
+    unsigned r_mask;            /* Size - 1 */
+    volatile unsigned r_inp;    /* Bytes ever added */
+    volatile unsigned r_outp;   /* Bytes ever removed */
+} ring;
+
+/* RING -- declare a ring with its buffer */
+#define RING(name, size) \
+    static unsigned char name##_buf[size]; \
+    static ring name = { name##_buf, (size)-1, 0, 0 }
+
+#define ring_barrier() asm volatile ("" ::: "memory")
+
+/* ring_count -- number of bytes waiting */
+#define ring_count(r) ((r)->r_inp - (r)->r_outp)
+
+/* ring_space -- number of bytes free */
+#define ring_space(r) ((r)->r_mask + 1 - ring_count(r))
+
+/* ring_init -- set up a ring with given storage */
+void ring_init(ring *r, void *buf, unsigned size);
+
+/* ring_put -- add a byte, returning 0 if the ring is full */
+int ring_put(ring *r, unsigned char ch);
+
+/* ring_get -- remove a byte, returning -1 if the ring is empty */
+int ring_get(ring *r);
+
+/* ring_write -- add up to n bytes, returning the number added */
+unsigned ring_write(ring *r, const void *src, unsigned n);
+
+/* ring_read -- remove up to n bytes, returning the number removed */
+unsigned ring_read(ring *r, void *dst, unsigned n);
+
+/* For zero-copy access, ring_peek() gives the longest contiguous span
+   of waiting bytes, and ring_consume() removes some of them once they
+   have been used.  Similarly, ring_reserve() gives the longest
+   contiguous span of free space, and ring_commit() publishes bytes
+   that have been stored there.  Calling either function again before
+   committing or consuming gives the same span. */
+
+/* ring_peek -- find contiguous waiting bytes, returning the count */
+unsigned ring_peek(ring *r, unsigned char **p);
+
+/* ring_consume -- remove n bytes found by ring_peek */
+void ring_consume(ring *r, unsigned n);
+
+/* ring_reserve -- find contiguous free space, returning the count */
+unsigned ring_reserve(ring *r, unsigned char **p);
+
+/* ring_commit -- add n bytes stored in space from ring_reserve */
+void ring_commit(ring *r, unsigned n);
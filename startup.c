@@ -46,32 +46,13 @@ void phos_interrupt(int irq);
 
 /* The C compiler may assume that implementations of the next four
    routines are provided, and use them, e.g., for translating
-   structure assignment: memcpy, memmove, memset, memcmp. */
+   structure assignment: memcpy, memmove, memset, memcmp.  The first
+   three are in assembly language in string-m0.s, because they are
+   used so often. */
 
-void *memcpy(void *dest, const void *src, unsigned n) {
-    unsigned char *p = dest;
-    const unsigned char *q = src;
-    while (n-- > 0) *p++ = *q++;
-    return dest;
-}
-
-void *memmove(void *dest, const void *src, unsigned n) {
-    unsigned char *p = dest;
-    const unsigned char *q = src;
-    if (dest <= src)
-        while (n-- > 0) *p++ = *q++;
-    else {
-        p += n; q += n;
-        while (n-- > 0) *--p = *--q;
-    }
-    return dest;
-}
-    
-void *memset(void *dest, unsigned x, unsigned n) {
-    unsigned char *p = dest;
-    while (n-- > 0) *p++ = x;
-    return dest;
-}
+void *memcpy(void *dest, const void *src, unsigned n);
+void *memmove(void *dest, const void *src, unsigned n);
+void *memset(void *dest, unsigned x, unsigned n);
 
 int memcmp(const void *pp, const void *qq, int n) {
     const unsigned char *p = pp, *q = qq;
@@ -88,8 +69,6 @@ extern unsigned __data_start[], __data_end[],
 
 /* __reset -- the system starts here */
 void __reset(void) {
-     unsigned *p, *q;
-
      // Make sure all RAM banks are powered on.
      POWER_RAMON |= BIT(0) | BIT(1);
 
@@ -100,8 +79,9 @@ void __reset(void) {
      while (! CLOCK_HFCLKSTARTED) { }
 
      // Copy data segment and zero out bss.
-     memcpy(__data_start, __etext, __data_end - __data_start);
-     memset(__bss_start, 0, __bss_end - __bss_start);
+     memcpy(__data_start, __etext,
+            (char *) __data_end - (char *) __data_start);
+     memset(__bss_start, 0, (char *) __bss_end - (char *) __bss_start);
   
 #ifdef PHOS
      phos_init();               // Initialise the scheduler.
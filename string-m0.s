@@ -0,0 +1,207 @@
+@
+@ string-m0.s
+@
+@ This file is part of the Phos operating system for microcontrollers
+@ Copyright (c) 2018 J. M. Spivey
+@ All rights reserved
+@ 
+@ Redistribution and use in source and binary forms, with or without
+@ modification, are permitted provided that the following conditions are met:
+@ 
+@ 1. Redistributions of source code must retain the above copyright notice,
+@    this list of conditions and the following disclaimer.
+@ 
+@ 2. Redistributions in binary form must reproduce the above copyright notice,
+@    this list of conditions and the following disclaimer in the documentation
+@    and/or other materials provided with the distribution.
+@ 
+@ 3. The name of the author may not be used to endorse or promote products
+@    derived from this software without specific prior written permission.
+@ 
+@ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+@ IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+@ OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+@ IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+@ SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+@ PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+@ OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+@ WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+@ OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+@ ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+@
+
+@@@ String routines for the ARM Cortex-M0
+
+@@@ The C compiler uses memcpy, memmove and memset for structure
+@@@ assignment and initialisation, so these versions move aligned data
+@@@ a word at a time, in bursts of 16 bytes with ldm and stm, and fall
+@@@ back on bytes only for unaligned heads and tails, for short blocks,
+@@@ and where source and destination are differently aligned.  Copying
+@@@ a 16-byte message between aligned buffers is treated specially,
+@@@ since every send and receive does it.
+
+        .syntax unified
+        .text
+
+@@@ memcpy -- copy n bytes from src to dest
+@@@ void *memcpy(void *dest, const void *src, unsigned n)
+        .global memcpy
+        .thumb_func
+memcpy:
+        cmp r2, #16             @ The size of a message?
+        bne 1f
+        mov r3, r0
+        orrs r3, r1
+        lsls r3, r3, #30        @ Both word-aligned?
+        bne 1f
+        ldm r1!, {r2, r3}       @ Copy 16 bytes without saving registers
+        stm r0!, {r2, r3}
+        ldm r1!, {r2, r3}
+        stm r0!, {r2, r3}
+        subs r0, #16            @ Return dest
+        bx lr
+
+1:      mov ip, r0              @ Save dest as result
+        cmp r2, #8
+        blo 8f                  @ Short: copy bytes
+        mov r3, r0
+        eors r3, r1
+        lsls r3, r3, #30        @ Same alignment?
+        bne 8f                  @ If not, copy bytes
+
+2:      lsls r3, r1, #30        @ Copy bytes until aligned
+        beq 3f
+        ldrb r3, [r1]
+        strb r3, [r0]
+        adds r1, #1
+        adds r0, #1
+        subs r2, #1
+        b 2b
+
+3:      push {r4-r6}
+        subs r2, #16
+        blo 5f
+4:      ldm r1!, {r3-r6}        @ Copy 16 bytes at a time
+        stm r0!, {r3-r6}
+        subs r2, #16
+        bhs 4b
+5:      pop {r4-r6}
+        adds r2, #16            @ 0 to 15 bytes left
+
+6:      subs r2, #4             @ Copy remaining words
+        blo 7f
+        ldm r1!, {r3}
+        stm r0!, {r3}
+        b 6b
+7:      adds r2, #4             @ 0 to 3 bytes left
+
+8:      cmp r2, #0              @ Copy remaining bytes
+        beq 10f
+9:      ldrb r3, [r1]
+        strb r3, [r0]
+        adds r1, #1
+        adds r0, #1
+        subs r2, #1
+        bne 9b
+
+10:     mov r0, ip
+        bx lr
+
+@@@ memmove -- copy n bytes from src to dest, allowing overlap
+@@@ void *memmove(void *dest, const void *src, unsigned n)
+        .global memmove
+        .thumb_func
+memmove:
+        cmp r0, r1              @ Copying downwards?
+        bhi 1f
+0:      b memcpy                @ If so, memcpy works from the start
+1:      adds r3, r1, r2
+        cmp r0, r3              @ No overlap?
+        bhs 0b
+
+        mov ip, r0              @ Copy backwards from the end
+        adds r0, r0, r2
+        mov r1, r3
+        cmp r2, #8
+        blo 5f                  @ Short: copy bytes
+        mov r3, r0
+        eors r3, r1
+        lsls r3, r3, #30        @ Same alignment?
+        bne 5f
+
+2:      lsls r3, r1, #30        @ Copy bytes until aligned
+        beq 3f
+        subs r1, #1
+        subs r0, #1
+        ldrb r3, [r1]
+        strb r3, [r0]
+        subs r2, #1
+        b 2b
+
+3:      subs r2, #4             @ Copy words
+        blo 4f
+        subs r1, #4
+        subs r0, #4
+        ldr r3, [r1]
+        str r3, [r0]
+        b 3b
+4:      adds r2, #4             @ 0 to 3 bytes left
+
+5:      cmp r2, #0              @ Copy remaining bytes
+        beq 7f
+6:      subs r1, #1
+        subs r0, #1
+        ldrb r3, [r1]
+        strb r3, [r0]
+        subs r2, #1
+        bne 6b
+
+7:      mov r0, ip
+        bx lr
+
+@@@ memset -- fill n bytes at dest with x
+@@@ void *memset(void *dest, unsigned x, unsigned n)
+        .global memset
+        .thumb_func
+memset:
+        mov ip, r0              @ Save dest as result
+        cmp r2, #8
+        blo 6f                  @ Short: set bytes
+
+1:      lsls r3, r0, #30        @ Set bytes until aligned
+        beq 2f
+        strb r1, [r0]
+        adds r0, #1
+        subs r2, #1
+        b 1b
+
+2:      uxtb r1, r1             @ Replicate byte in all of r1
+        lsls r3, r1, #8
+        orrs r1, r3
+        lsls r3, r1, #16
+        orrs r1, r3
+        mov r3, r1
+
+        subs r2, #16
+        blo 4f
+3:      stm r0!, {r1, r3}       @ Set 16 bytes at a time
+        stm r0!, {r1, r3}
+        subs r2, #16
+        bhs 3b
+4:      adds r2, #16            @ 0 to 15 bytes left
+
+5:      subs r2, #4             @ Set remaining words
+        blo 55f
+        stm r0!, {r1}
+        b 5b
+55:     adds r2, #4             @ 0 to 3 bytes left
+
+6:      cmp r2, #0              @ Set remaining bytes
+        beq 8f
+7:      strb r1, [r0]
+        adds r0, #1
+        subs r2, #1
+        bne 7b
+
+8:      mov r0, ip
+        bx lr
@@ -0,0 +1,268 @@
+/*
+ * fmtbench.c
+ *
+ * This file is part of the Phos operating system for microcontrollers
+ * Copyright (c) 2018 J. M. Spivey
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host benchmark for the formatter in lib.c.  Build and run with
+
+       cc -O2 -I . tools/fmtbench.c -o fmtbench && ./fmtbench
+
+   from the top of the source tree.  The program first checks the
+   output of snprintf from lib.c against the host C library for many
+   formats, then times it against the old formatter that divided by 10
+   for each digit.  The host has a divide instruction, so the old
+   formatter is also timed with a shift-and-subtract division routine
+   like the one in libgcc that the Cortex-M0 must use. */
+
+/* Rename the functions in lib.c so that they do not clash with the C
+   library */
+#define atoi lib_atoi
+#define xtou lib_xtou
+#define sprintf lib_sprintf
+#define snprintf lib_snprintf
+#define vsnprintf lib_vsnprintf
+#include "lib.c"
+#undef atoi
+#undef xtou
+#undef sprintf
+#undef snprintf
+#undef vsnprintf
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* soft_udiv -- unsigned division by shifting and subtracting */
+static unsigned soft_udiv(unsigned x, unsigned y, unsigned *rem) {
+    unsigned q = 0, r = 0;
+
+    for (int i = 31; i >= 0; i--) {
+        r = (r << 1) | ((x >> i) & 1);
+        if (r >= y) {
+            r -= y; q |= 1u << i;
+        }
+    }
+
+    *rem = r;
+    return q;
+}
+
+static int use_soft = 0;        /* Whether old_utoa uses soft_udiv */
+
+/* old_utoa -- the old conversion, using division */
+static char *old_utoa(unsigned x, unsigned base, char *nbuf) {
+    char *p = &nbuf[NMAX];
+    const char *hex = "0123456789abcdef";
+    unsigned r;
+
+    *--p = '\0';
+    do {
+        if (use_soft) {
+            x = soft_udiv(x, base, &r);
+            *--p = hex[r];
+        } else {
+            *--p = hex[x % base];
+            x = x / base;
+        }
+    } while (x != 0);
+
+    return p;
+}
+
+/* old_print -- the old formatter for %d, %u, %x and %s, one call
+   per character */
+static void old_print(void (*fputc)(void *, char), void *q,
+                      const char *fmt, va_list va) {
+    char nbuf[NMAX], *s;
+    int v;
+
+    for (const char *p = fmt; *p != 0; p++) {
+        if (*p == '%' && *(p+1) != '\0') {
+            switch (*++p) {
+            case 'd':
+                v = va_arg(va, int);
+                if (v >= 0)
+                    s = old_utoa(v, 10, nbuf);
+                else {
+                    s = old_utoa(-v, 10, nbuf);
+                    *--s = '-';
+                }
+                break;
+            case 'u':
+                s = old_utoa(va_arg(va, unsigned), 10, nbuf);
+                break;
+            case 'x':
+                s = old_utoa(va_arg(va, unsigned), 16, nbuf);
+                break;
+            case 's':
+                s = va_arg(va, char *);
+                break;
+            default:
+                fputc(q, *p);
+                continue;
+            }
+            while (*s != '\0') fputc(q, *s++);
+        } else {
+            fputc(q, *p);
+        }
+    }
+}
+
+/* old_storec -- store a character for old_sprintf */
+static void old_storec(void *q, char c) {
+    char **p = q;
+    *(*p)++ = c;
+}
+
+/* old_sprintf -- sprintf with the old formatter */
+static int old_sprintf(char *buf, const char *fmt, ...) {
+    char *p = buf;
+    va_list va;
+
+    va_start(va, fmt);
+    old_print(old_storec, &p, fmt, va);
+    va_end(va);
+    *p = '\0';
+    return p - buf;
+}
+
+
+/* CHECKING */
+
+static int errors = 0;
+
+/* check -- compare lib_snprintf with snprintf for one format */
+static void check(const char *fmt, const char *hostfmt, long x) {
+    char buf1[64], buf2[64];
+    int n1, n2;
+
+    n1 = lib_snprintf(buf1, sizeof(buf1), fmt, x);
+    n2 = snprintf(buf2, sizeof(buf2), hostfmt, x);
+    if (n1 != n2 || strcmp(buf1, buf2) != 0) {
+        printf("Mismatch for %s: \"%s\" (%d) vs \"%s\" (%d)\n",
+               fmt, buf1, n1, buf2, n2);
+        errors++;
+    }
+}
+
+/* check_all -- check many formats and values */
+static void check_all(void) {
+    static const char *formats[][2] = {
+        { "%ld", "%ld" }, { "%lu", "%lu" }, { "%lx", "%#lx" },
+        { "%8ld", "%8ld" }, { "%-8ld|", "%-8ld|" }, { "%08ld", "%08ld" },
+        { "%012lx", "%#012lx" }, { "%-12lx|", "%#-12lx|" },
+        { "%3lu", "%3lu" }, { "%1ld", "%1ld" }
+    };
+    char buf[8];
+    int n;
+
+    for (int i = 0; i < 100000; i++) {
+        long x = (long) (((unsigned long) random() << 33)
+                         ^ ((unsigned long) random() << 11) ^ random());
+        if (i % 4 == 1) x = (int) x;
+        if (i % 4 == 2) x = x % 100000;
+        if (i % 4 == 3) x = i - 50;
+
+        for (unsigned k = 0; k < sizeof(formats)/sizeof(formats[0]); k++)
+            check(formats[k][0], formats[k][1], x);
+    }
+
+    // Plain ints, strings, characters and truncation
+    lib_snprintf(buf, sizeof(buf), "%d%s%c", -2147483647-1, "x", 'y');
+    if (strcmp(buf, "-214748") != 0) {
+        printf("Bad truncation: \"%s\"\n", buf);
+        errors++;
+    }
+    n = lib_snprintf(buf, sizeof(buf), "<%c>%3c%-2c|", '\0', 'a', 'b');
+    if (n != 9 || memcmp(buf, "<\0>  ab", 8) != 0) {
+        printf("Bad %%c output (%d)\n", n);
+        errors++;
+    }
+    n = lib_snprintf(NULL, 0, "%5s|%-5s|%%", "ab", "cd");
+    if (n != 13) {
+        printf("Bad length %d for null buffer\n", n);
+        errors++;
+    }
+
+    printf("Checks: %d errors\n", errors);
+}
+
+
+/* TIMING */
+
+#define REPS 1000000
+
+/* now -- time in ns */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static volatile unsigned sink_count;
+
+/* bench -- time a formatter on a format with one int argument */
+static void bench(const char *fmt, unsigned val) {
+    char buf[64];
+    double t0, t_new, t_old, t_soft;
+
+    t0 = now();
+    for (int i = 0; i < REPS; i++)
+        sink_count += lib_sprintf(buf, fmt, val + (i & 7));
+    t_new = (now() - t0) / REPS;
+
+    use_soft = 0;
+    t0 = now();
+    for (int i = 0; i < REPS; i++)
+        sink_count += old_sprintf(buf, fmt, val + (i & 7));
+    t_old = (now() - t0) / REPS;
+
+    use_soft = 1;
+    t0 = now();
+    for (int i = 0; i < REPS; i++)
+        sink_count += old_sprintf(buf, fmt, val + (i & 7));
+    t_soft = (now() - t0) / REPS;
+
+    printf("%-10s %10u %8.1f %8.1f %8.1f\n", fmt, val, t_new, t_old, t_soft);
+}
+
+int main(void) {
+    check_all();
+
+    printf("\n%-10s %10s %8s %8s %8s\n", "format", "value",
+           "new(ns)", "old(ns)", "old-soft");
+    bench("%u", 7);
+    bench("%u", 65535);
+    bench("%u", 4000000000u);
+    bench("%d", 123456);
+    bench("%x", 0xdeadbeef);
+    bench("pid=%d;", 12);
+
+    return (errors > 0);
+}
@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+#
+# trace2json.py
+#
+# This file is part of the Phos operating system for microcontrollers
+# Copyright (c) 2018 J. M. Spivey
+# All rights reserved
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#    this list of conditions and the following disclaimer in the documentation
+#    and/or other materials provided with the distribution.
+# 3. The name of the author may not be used to endorse or promote products
+#    derived from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+# IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+# PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+# OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+# WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+# OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+# ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+# Convert a Phos kernel trace, captured from the serial port after
+# typing CTRL-T, into JSON for chrome://tracing or ui.perfetto.dev.
+#
+# Usage: trace2json.py [-n pid=name ...] capture.bin > trace.json
+#
+# The capture may contain ordinary text before and after the trace:
+# only the frames between "TRC1" and "TEND" are used.
+
+import sys, json, struct, argparse
+
+FLAG = 0x7e
+ESC = 0x7d
+
+# Event codes: keep them in step with phos.c
+TR_SWITCH = 1
+TR_SEND = 2
+TR_SENDREC = 3
+TR_RECEIVE = 4
+TR_NOTIFY = 5
+TR_INTR = 6
+TR_TIMEOUT = 7
+
+TR_ANY = 0xfe
+TR_HARDWARE = 0xff
+
+# Names of the standard processes from phos.h
+NAMES = { 0: "Idle", 1: "Serial", 2: "Timer", 3: "I2C", 4: "Radio",
+          5: "Random", 6: "Temp", 7: "Adc" }
+
+def frames(data):
+    """Split the capture into unescaped frames"""
+    buf = None
+    esc = False
+    for b in data:
+        if b == FLAG:
+            if buf: yield bytes(buf)
+            buf = bytearray()
+            esc = False
+        elif buf is None:
+            pass                # Text before the first frame
+        elif esc:
+            buf.append(b ^ 0x20)
+            esc = False
+        elif b == ESC:
+            esc = True
+        else:
+            buf.append(b)
+
+def records(data):
+    """Extract the trace records from a capture"""
+    inside = False
+    for f in frames(data):
+        if f == b"TRC1":
+            inside = True
+        elif f == b"TEND":
+            inside = False
+        elif inside and len(f) == 8:
+            yield struct.unpack("<IBBBB", f)
+
+def who(x):
+    if x == TR_ANY: return "ANY"
+    if x == TR_HARDWARE: return "HARDWARE"
+    return str(x)
+
+def convert(recs, names):
+    events = []
+    seen = set()
+    running = None              # (pid, start time) of current slice
+    base = None
+    last = 0
+    high = 0
+
+    for (t, ev, pid, arg, typ) in recs:
+        # Extend the 32-bit timestamps, which wrap after 71 minutes
+        if base is not None and t < last: high += 1 << 32
+        last = t
+        t += high
+        if base is None: base = t
+        ts = t - base
+        seen.add(pid)
+
+        def instant(name, **args):
+            events.append({ "name": name, "ph": "i", "s": "t", "ts": ts,
+                            "pid": 1, "tid": pid, "args": args })
+
+        if ev == TR_SWITCH:
+            if running is not None:
+                (p0, t0) = running
+                events.append({ "name": "run", "ph": "X", "ts": t0,
+                                "dur": ts - t0, "pid": 1, "tid": p0 })
+            running = (pid, ts)
+        elif ev == TR_SEND:
+            instant("send to " + who(arg), dst=arg, type=typ)
+        elif ev == TR_SENDREC:
+            instant("sendrec to " + who(arg), dst=arg, type=typ)
+        elif ev == TR_RECEIVE:
+            instant("receive from " + who(arg), src=arg)
+        elif ev == TR_NOTIFY:
+            instant("notify " + who(arg), dst=arg, bits=typ)
+        elif ev == TR_INTR:
+            instant("irq %d" % arg, irq=arg)
+        elif ev == TR_TIMEOUT:
+            instant("timeout")
+        else:
+            instant("event %d" % ev, arg=arg, type=typ)
+
+    # Close the last slice at the time of the last event
+    if running is not None:
+        (p0, t0) = running
+        events.append({ "name": "run", "ph": "X", "ts": t0,
+                        "dur": last + high - base - t0, "pid": 1, "tid": p0 })
+
+    for pid in sorted(seen):
+        name = names.get(pid, "Process %d" % pid)
+        events.append({ "name": "thread_name", "ph": "M", "pid": 1,
+                        "tid": pid, "args": { "name": name } })
+
+    return { "traceEvents": events, "displayTimeUnit": "ms" }
+
+def main():
+    ap = argparse.ArgumentParser(description="Convert a Phos trace to JSON")
+    ap.add_argument("-n", "--name", action="append", default=[],
+                    metavar="PID=NAME", help="name a process")
+    ap.add_argument("capture", help="binary capture from the serial port")
+    args = ap.parse_args()
+
+    names = dict(NAMES)
+    for spec in args.name:
+        (pid, name) = spec.split("=", 1)
+        names[int(pid)] = name
+
+    with open(args.capture, "rb") as f:
+        data = f.read()
+
+    json.dump(convert(records(data), names), sys.stdout, indent=1)
+    print()
+
+if __name__ == "__main__":
+    main()